@@ -0,0 +1,108 @@
+/*
+  cheap-top: watch the scopes of a running program.
+
+  Run the program with CHEAP_LIVE=1 (and LD_PRELOAD=libcheap.so, if it
+  is not linked with it), then:
+
+    cheap-top <pid> [interval-seconds [iterations]]
+
+  Every interval (default 1s), shows for each scope site the rate of
+  scope entries, bytes, region refills, spills (requests made in the
+  scope but served by the heap) and ignored frees, plus the most bytes
+  requested in a single instance. See livestats.h.
+*/
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "livestats.h"
+
+class snapshot {
+public:
+  uint64_t entries;
+  uint64_t bytes;
+  uint64_t refills;
+  uint64_t spills;
+  uint64_t ignoredFrees;
+};
+
+static snapshot take(const cheap::live_stats::site& s) {
+  return snapshot { s.entries.load(std::memory_order_relaxed),
+		    s.bytes.load(std::memory_order_relaxed),
+		    s.refills.load(std::memory_order_relaxed),
+		    s.spills.load(std::memory_order_relaxed),
+		    s.ignoredFrees.load(std::memory_order_relaxed) };
+}
+
+int main(int argc, char * argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <pid> [interval-seconds [iterations]]\n", argv[0]);
+    return 1;
+  }
+  int pid = atoi(argv[1]);
+  double interval = (argc > 2) ? atof(argv[2]) : 1.0;
+  long iterations = (argc > 3) ? atol(argv[3]) : -1;
+  if (interval <= 0) {
+    interval = 1.0;
+  }
+
+  char name[64];
+  cheap::live_stats::segmentName(name, sizeof(name), pid);
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    fprintf(stderr, "cheap-top: no stats for process %d (was it run with CHEAP_LIVE=1?)\n", pid);
+    return 1;
+  }
+  auto * page = (const cheap::live_stats *) mmap(nullptr, sizeof(cheap::live_stats), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if ((page == MAP_FAILED)
+      || (__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) != (uint32_t) cheap::live_stats::Magic)
+      || (page->version != cheap::live_stats::Version)) {
+    fprintf(stderr, "cheap-top: %s is not a cheap stats segment this version understands\n", name);
+    return 1;
+  }
+
+  // Show rates, not totals since the program started.
+  static snapshot previous[cheap::live_stats::MaxSites];
+  for (uint32_t s = 0; s < page->count.load(std::memory_order_acquire); s++) {
+    previous[s] = take(page->sites[s]);
+  }
+  bool tty = isatty(1);
+  for (long i = 0; (iterations < 0) || (i < iterations); i++) {
+    struct timespec delay { (time_t) interval, (long) ((interval - (time_t) interval) * 1e9) };
+    nanosleep(&delay, nullptr);
+    auto count = page->count.load(std::memory_order_acquire);
+    if (tty) {
+      printf("\033[H\033[2J");
+    }
+    printf("cheap-top: process %d, %u scope sites, per second over %.1fs\n\n", pid, count, interval);
+    printf("%10s %12s %10s %10s %10s %12s  %s\n",
+	   "entries", "bytes", "refills", "spills", "ign.frees", "peak bytes", "scope");
+    for (uint32_t s = 0; s < count; s++) {
+      auto& site = page->sites[s];
+      auto now = take(site);
+      auto& then = previous[s];
+      printf("%10.0f %12.0f %10.0f %10.0f %10.0f %12llu  %.*s\n",
+	     (now.entries - then.entries) / interval,
+	     (now.bytes - then.bytes) / interval,
+	     (now.refills - then.refills) / interval,
+	     (now.spills - then.spills) / interval,
+	     (now.ignoredFrees - then.ignoredFrees) / interval,
+	     (unsigned long long) site.peak.load(std::memory_order_relaxed),
+	     (int) sizeof(site.name), site.name);
+      then = now;
+    }
+    fflush(stdout);
+    if (kill(pid, 0) != 0) {
+      printf("\ncheap-top: process %d has exited\n", pid);
+      break;
+    }
+  }
+  return 0;
+}
@@ -10,11 +10,87 @@
 #include <malloc.h>
 #endif
 
+/* C API: open a scope with cheap_begin() and close it with cheap_end().
+   Scopes on a thread must be ended in the reverse order they began. */
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+  /* Scope options (the same bits as cheap::flags in C++). */
+  enum cheap_flags {
+    CHEAP_ALIGNED = 0x01,
+    CHEAP_NONZERO = 0x02,
+    CHEAP_SIZE_TAKEN = 0x04,
+    CHEAP_SINGLE_THREADED = 0x08,
+    CHEAP_DISABLE_FREE = 0x10,
+    CHEAP_SAME_SIZE = 0x20,
+    CHEAP_FIXED_BUFFER = 0x40,
+    CHEAP_INHERIT_THREADS = 0x80
+  };
+
+  typedef struct cheap_scope * cheap_handle_t;
+
+  /* A position in a region scope, for cheap_rewind(). */
+  typedef struct cheap_mark_s {
+    void * state[4];
+  } cheap_mark_t;
+
+  /* Start a scope: with CHEAP_SAME_SIZE, size_hint is the object size
+     (and a CHEAP_DISABLE_FREE region starts with the default chunk);
+     otherwise, with CHEAP_DISABLE_FREE, it is the size of the first
+     chunk (0 = default). Returns NULL if the flags don't describe a
+     supported scope (CHEAP_FIXED_BUFFER is C++-only). */
+  cheap_handle_t cheap_begin(int flags, size_t size_hint);
+
+  /* End a scope, releasing all of its memory. */
+  void cheap_end(cheap_handle_t scope);
+
+  /* Remember the allocation position of a CHEAP_DISABLE_FREE scope... */
+  cheap_mark_t cheap_mark(cheap_handle_t scope);
+
+  /* ...and release everything allocated in it since then. */
+  void cheap_rewind(cheap_handle_t scope, cheap_mark_t mark);
+
+  /* What a scope has done so far. */
+  typedef struct cheap_stats_s {
+    unsigned long long allocations;   /* requests made in the scope */
+    unsigned long long bytes;         /* bytes requested */
+    unsigned long long refills;       /* chunks its region obtained */
+    unsigned long long ignored_frees; /* frees that were no-ops */
+  } cheap_stats_t;
+
+  /* The counters of scope (NULL = the current scope). All zero unless
+     libcheap was built with -DUSE_SCOPE_STATS=1. */
+  cheap_stats_t cheap_stats(cheap_handle_t scope);
+
 #if defined(__cplusplus)
+}
+#endif
+
+#if defined(__cplusplus)
+
+// Build modes: by default libcheap is a shared library. With
+// CHEAP_STATIC, it is linked from libcheap.a into the executable. With
+// CHEAP_HEADER_ONLY, there is no libcheap at all: scopes only capture
+// operator new/delete, which cheap_new.h replaces (in one file).
+#if !defined(CHEAP_STATIC)
+#define CHEAP_STATIC 0
+#endif
+#if !defined(CHEAP_HEADER_ONLY)
+#define CHEAP_HEADER_ONLY 0
+#endif
 
 #include "common.hpp"
 #include "regionheap.h"
+#include "ownership.h"
 #include "nextheap.hpp"
+#include "generalheap.h"
+#include "sizecache.h"
+#include "sitefilter.h"
+#include "sitearenas.h"
+#include "scopestats.h"
+#include "probes.h"
 
 using namespace HL;
 
@@ -35,34 +111,120 @@ public:
   }
 };
 
-class TopHeap : public SizeHeap<ZoneHeap<SizedMmapHeap, 65536>> {};
+class TopHeap : public SizeHeap<ZoneHeap<OwnedMmapHeap, 65536>> {};
 
 class CheapHeapType :
   public KingsleyHeap<AdaptHeap<DLList, TopHeap>, TopHeap> {};
 
-class CheapRegionHeap :
-  public RegionHeap<CheapHeapType, 2, 1, 3 * 1048576> {};
+// Region chunk events, reported to libcheap for tracing (see
+// CHEAP_TRACE). chunkEventStart() is 0 unless libcheap is tracing.
+#if CHEAP_HEADER_ONLY
+inline uint64_t chunkEventStart() { return 0; }
+inline void chunkEvent(bool, uint64_t, size_t) {}
+#else
+extern uint64_t chunkEventStart();
+extern void chunkEvent(bool acquired, uint64_t start, size_t sz);
+#endif
+
+/// Reports each chunk a region obtains (in a refill) or releases.
+template <class SuperHeap>
+class ChunkEventHeap : public SuperHeap {
+public:
+  inline void * malloc(size_t sz) {
+    auto start = chunkEventStart();
+    auto ptr = SuperHeap::malloc(sz);
+    CHEAP_PROBE2(refill, ptr, sz);
+    if (unlikely(start != 0)) {
+      chunkEvent(true, start, sz);
+    }
+    return ptr;
+  }
+
+  inline void free(void * ptr) {
+    auto start = chunkEventStart();
+    CHEAP_PROBE1(release, ptr);
+    SuperHeap::free(ptr);
+    if (unlikely(start != 0)) {
+      chunkEvent(false, start, 0);
+    }
+  }
+};
+
+typedef RegionHeap<ChunkEventHeap<CheapHeapType>, 2, 1, 3 * 1048576> CheapRegionBase;
+
+// The geometry of every CheapRegionHeap: CheapRegionBase's (3MB
+// chunks, doubling), unless overridden by the environment when the
+// program starts (see cheap::region_geometry).
+#if CHEAP_HEADER_ONLY
+inline const cheap::region_geometry& regionGeometry() {
+  static const auto g = cheap::region_geometry::fromEnvironment(CheapRegionBase::defaultGeometry());
+  return g;
+}
+#else
+extern const cheap::region_geometry& regionGeometry();
+#endif
+
+class CheapRegionHeap : public CheapRegionBase {
+public:
+  CheapRegionHeap(size_t initialChunkSize = defaultChunkSize())
+    : CheapRegionBase(initialChunkSize, regionGeometry())
+  {}
+
+  static size_t defaultChunkSize() {
+    return regionGeometry().initialChunkSize;
+  }
+};
+
+/// Counts the requests that reach SuperHeap (for a freelist, the ones
+/// it could not satisfy from freed objects).
+template <class SuperHeap>
+class MissCountingHeap : public SuperHeap {
+public:
+  inline void * malloc(size_t sz) {
+    _misses++;
+    return SuperHeap::malloc(sz);
+  }
+  inline uint64_t misses() const {
+    return _misses;
+  }
+private:
+  uint64_t _misses {0};
+};
 
 class CheapFreelistHeap :
-  public FreelistHeap<ZoneHeap<SizedMmapHeap,
-			       4096>> {};
+  public FreelistHeap<MissCountingHeap<ZoneHeap<OwnedMmapHeap,
+						4096>>> {};
 
 namespace cheap {
 
   enum flags {
-    ALIGNED = 0b0000'0001,  // no need to align sizes
-    NONZERO = 0b0000'0010,  // no zero size requests
-    SIZE_TAKEN = 0b0000'0100, // need support for size
-    SINGLE_THREADED = 0b0000'1000, // all requests the same size - use freelist
-    DISABLE_FREE = 0b0001'0000, // frees -> NOPs: use a "region" allocator
-    SAME_SIZE = 0b0010'0000, // all requests the same size
-    FIXED_BUFFER = 0b0100'0000, // use a specified buffer
+    ALIGNED = CHEAP_ALIGNED,  // no need to align sizes
+    NONZERO = CHEAP_NONZERO,  // no zero size requests
+    SIZE_TAKEN = CHEAP_SIZE_TAKEN, // need support for size
+    SINGLE_THREADED = CHEAP_SINGLE_THREADED, // all requests the same size - use freelist
+    DISABLE_FREE = CHEAP_DISABLE_FREE, // frees -> NOPs: use a "region" allocator
+    SAME_SIZE = CHEAP_SAME_SIZE, // all requests the same size
+    FIXED_BUFFER = CHEAP_FIXED_BUFFER, // use a specified buffer
+    INHERIT_THREADS = CHEAP_INHERIT_THREADS, // threads created in scope get a sub-arena
   };
 
   class cheap_base;
 }
 
+#if CHEAP_HEADER_ONLY
+inline cheap::cheap_base*& current() {
+  static __thread cheap::cheap_base * c __attribute__((tls_model ("initial-exec")));
+  return c;
+}
+#elif CHEAP_STATIC
+// Linked into the executable, so this is a direct TLS access.
+extern __thread cheap::cheap_base * cheap_current_scope __attribute__((tls_model ("initial-exec")));
+inline cheap::cheap_base*& current() {
+  return cheap_current_scope;
+}
+#else
 extern cheap::cheap_base*& current();
+#endif
 
 namespace cheap {
   class cheap_base {
@@ -71,8 +233,130 @@ namespace cheap {
     inline __attribute__((always_inline)) virtual void free(void *) = 0;
     inline __attribute__((always_inline)) virtual size_t getSize(void *) = 0;
     //    virtual void * memalign(size_t, size_t) = 0;
+    /// Returns the scope a thread created inside this one should use
+    /// (nullptr = the new thread starts outside any scope).
+    virtual cheap_base * spawn() { return nullptr; }
+    /// Chunks obtained so far by this scope's region, if it has one.
+    virtual uint64_t refills() const { return 0; }
+    /// The total size of those chunks.
+    virtual uint64_t refilledBytes() const { return 0; }
+    /// True if ptr, just returned by this scope's malloc, is known to
+    /// be zero (fresh region memory), so calloc can skip clearing it.
+    virtual bool untouched(void *) const { return false; }
+    /// The scope that was current when this one opened (which serves
+    /// its allocations if libcheap bypasses it).
+    virtual cheap_base * enclosing() const { return nullptr; }
     bool in_cheap {false};
+    /// Set when malloc is just a bump of this region (see scope_malloc).
+    CheapRegionHeap * bump {nullptr};
+    /// Set when objects come from (and are freed to) this freelist.
+    CheapFreelistHeap * freelist {nullptr};
+    /// Usable size of every object this scope frees, if its frees can
+    /// go through a size_cache (0 = they cannot).
+    size_t cache_size {0};
+    /// This scope's size_cache owner id, assigned by libcheap on first use.
+    uintptr_t cache_id {0};
+    /// If set, only allocations made from code in this filter are
+    /// captured; the rest go to the normal heap.
+    const site_filter * filter {nullptr};
+
+    /// Only capture allocations made from code in f (which must outlive
+    /// the scope).
+    void capture_only(const site_filter& f) {
+      filter = &f;
+    }
+
+    /// If set, allocations are grouped by call site (see colocate_by_site).
+    site_arenas<CheapRegionHeap> * sites {nullptr};
+#if USE_SCOPE_STATS
+    scope_instance own_instance;
+    /// Measurements of this instance: always own_instance.
+    scope_instance * instance {&own_instance};
+#else
+    /// Measurements of this instance, if libcheap is taking them (kept
+    /// out of line, so unmeasured scopes stay small).
+    scope_instance * instance {nullptr};
+#endif
+
+    /// True iff the current allocation should come from this scope.
+    inline __attribute__((always_inline)) bool captures() const {
+      return likely(filter == nullptr) || filter->matches_caller();
+    }
   };
+
+  /// True iff ci, the current scope, may take back ptr (scope memory
+  /// being freed): a freelist only takes objects it handed out. Others
+  /// (from an enclosing scope, an arena or a region) are reclaimed
+  /// when whatever allocated them is.
+  inline __attribute__((always_inline)) bool frees_to(const cheap_base * ci, const void * ptr, const owner_map& map = theOwnerMap()) {
+    return !ci->freelist || (map.owner(ptr) == ci->freelist->id());
+  }
+
+}
+
+// Scope instrumentation: libcheap measures scope instances (and may
+// bypass some, in A/B mode) between these calls. file and line
+// identify C++ scopes; pc identifies those opened through the C API.
+#if CHEAP_HEADER_ONLY
+inline void scopeOpened(cheap::cheap_base * scope, const char *, int, uintptr_t = 0) {
+#if USE_SCOPE_STATS
+  scope->instance->refillsAtOpen = scope->refills();
+#else
+  (void) scope;
+#endif
+}
+inline void scopeClosed(cheap::cheap_base *) {}
+#else
+extern void scopeOpened(cheap::cheap_base * scope, const char * file, int line, uintptr_t pc = 0);
+extern void scopeClosed(cheap::cheap_base * scope);
+#endif
+
+namespace cheap {
+  typedef cheap_stats_t scope_stats;
+
+  /// What scope has done so far (see USE_SCOPE_STATS): allocations
+  /// and bytes requested in it, chunks its region obtained, and frees
+  /// it ignored. Without USE_SCOPE_STATS, everything is zero.
+  inline scope_stats stats(const cheap_base * scope = current()) {
+    scope_stats s {};
+#if USE_SCOPE_STATS
+    if (scope) {
+      s.allocations = scope->instance->allocations;
+      s.bytes = scope->instance->bytes;
+      s.refills = scope->refills() - scope->instance->refillsAtOpen;
+      s.ignored_frees = scope->instance->ignoredFrees;
+    }
+#else
+    (void) scope;
+#endif
+    return s;
+  }
+
+  /// Count a request made in scope ci (which has an instance).
+  inline __attribute__((always_inline)) void count_malloc(cheap_base * ci, size_t sz) {
+    ci->instance->allocations++;
+    ci->instance->bytes += sz;
+  }
+
+  /// Allocate from an active scope, bumping plain regions directly
+  /// instead of making a virtual call.
+  inline __attribute__((always_inline)) void * scope_malloc(cheap_base * ci, size_t sz) {
+    if (likely(ci->bump != nullptr)) {
+      if (sz < MIN_ALIGNMENT) {
+	sz = MIN_ALIGNMENT;
+      }
+      return ci->bump->malloc((sz + MIN_ALIGNMENT - 1) & ~(MIN_ALIGNMENT - 1));
+    }
+    return ci->malloc(sz);
+  }
+
+  /// Allocate from a scope that colocates by site (ci->sites is set).
+  inline void * site_malloc(cheap_base * ci, uintptr_t site, size_t sz) {
+    if (sz < MIN_ALIGNMENT) {
+      sz = MIN_ALIGNMENT;
+    }
+    return ci->sites->malloc(site, (sz + MIN_ALIGNMENT - 1) & ~(MIN_ALIGNMENT - 1));
+  }
 }
 
 namespace cheap {
@@ -92,20 +376,77 @@ namespace cheap {
     static constexpr bool sizeTaken = Flags & flags::SIZE_TAKEN;
     static constexpr bool useFixedBuffer = Flags & flags::FIXED_BUFFER;
     static constexpr bool allSameSize = Flags & flags::SAME_SIZE;
+    static constexpr bool inheritThreads = Flags & flags::INHERIT_THREADS;
+
+    template <const int> friend class cheap;
+
+    // Sub-arenas never share the parent's fixed buffer.
+    typedef cheap<Flags & ~flags::FIXED_BUFFER> child_scope;
     
   public:
     inline cheap(size_t sz = 8,
 		 char * buf = nullptr,
-		 size_t bufSz = 0)
+		 size_t bufSz = 0,
+		 const char * file = __builtin_FILE(),
+		 int line = __builtin_LINE())
+      : _region (getRegion()),
+	_freelist (getFreelist())
     {
-      static_assert(flags::ALIGNED ^ flags::NONZERO ^ flags::SIZE_TAKEN ^ flags::SINGLE_THREADED ^ flags::DISABLE_FREE ^ flags::SAME_SIZE ^ flags::FIXED_BUFFER == (1 << 8) - 1,
+      static_assert((flags::ALIGNED ^ flags::NONZERO ^ flags::SIZE_TAKEN ^ flags::SINGLE_THREADED ^ flags::DISABLE_FREE ^ flags::SAME_SIZE ^ flags::FIXED_BUFFER ^ flags::INHERIT_THREADS) == (1 << 8) - 1,
 		    "Flags must be one bit and mutually exclusive.");
       static_assert(disableFrees || allSameSize, "Either frees must be disabled (DISABLE_FREE), or all requests must be the same size (SAME_SIZE).");
       _oneSize = sz;
       _buf = buf;
-      _bufSz = bufSz;
+      if (useFixedBuffer) {
+	// Frees are only routed to scopes for memory they own (exactly the
+	// buffer, not the rest of its pages).
+	theOwnerMap().addFixed(_fixedRange, buf, bufSz);
+      }
+      if (disableFrees && !(sizeTaken || allSameSize || useFixedBuffer)) {
+	bump = _region;
+      }
+      if (!disableFrees) {
+	cache_size = _oneSize;
+	freelist = _freelist;
+      }
+      _previous = current();
       current() = this;
       in_cheap = true;
+      CHEAP_PROBE3(scope_begin, this, file, line);
+      scopeOpened(this, file, line);
+    }
+
+    /// Bump objects from each allocation site into that site's own
+    /// sub-arena, so they end up contiguous. Plain regions only; sites
+    /// are identified by libcheap (shared builds) or cheap_new.h.
+    void colocate_by_site() {
+      static_assert(disableFrees && !(sizeTaken || allSameSize || useFixedBuffer),
+		    "Only plain regions (DISABLE_FREE without sizes or a fixed buffer) can colocate by site.");
+      if (!sites) {
+	auto * buf = _region->malloc((sizeof(site_arenas<CheapRegionHeap>) + MIN_ALIGNMENT - 1) & ~(MIN_ALIGNMENT - 1));
+	if (buf) {
+	  sites = new (buf) site_arenas<CheapRegionHeap>(_region);
+	}
+      }
+    }
+
+    /// Hand a newly created thread its own sub-arena, which lives until
+    /// this scope ends. Threads must be joined before then.
+    cheap_base * spawn() override {
+      if (!inheritThreads) {
+	return nullptr;
+      }
+      auto * buf = HL::MmapWrapper::map(sizeof(child));
+      if (!buf) {
+	return nullptr;
+      }
+      auto * c = new (buf) child(_oneSize);
+      c->scope.filter = filter;
+      _childLock.lock();
+      c->next = _children;
+      _children = c;
+      _childLock.unlock();
+      return &c->scope;
     }
     
     inline __attribute__((always_inline)) void * malloc(size_t req_sz) {
@@ -128,14 +469,14 @@ namespace cheap {
 	    ptr = _buf;
 	    _buf += sz;
 	  } else {
-	    ptr = getRegion()->malloc(sz);
+	    ptr = _region->malloc(sz);
 	  }
 	} else {
 	  if (useFixedBuffer) {
 	    ptr = _buf;
 	    _buf += sz + sizeof(cheap_header);
 	  } else {
-	    ptr = getRegion()->malloc(sz + sizeof(cheap_header));
+	    ptr = _region->malloc(sz + sizeof(cheap_header));
 	  }
 	  // Prepend an object header.
 	  new (ptr) cheap_header(sz);
@@ -143,7 +484,7 @@ namespace cheap {
 	}
       } else {
 	assert(sz == req_sz);
-	ptr = getFreelist()->malloc(sz);
+	ptr = _freelist->malloc(sz);
       }
       return ptr;
     }
@@ -151,7 +492,11 @@ namespace cheap {
       //      tprintf::tprintf("current now = @\n", current());
       assert(in_cheap);
       if (!disableFrees) {
-	getFreelist()->free(ptr);
+	_freelist->free(ptr);
+      } else {
+#if USE_SCOPE_STATS
+	instance->ignoredFrees++;
+#endif
       }
     }
     inline size_t getSize(void * ptr) {
@@ -170,18 +515,79 @@ namespace cheap {
     inline void * memalign(size_t, size_t) {
     }
 #endif
+    uint64_t refills() const override {
+      return (disableFrees && !useFixedBuffer) ? _region->refills() : 0;
+    }
+    uint64_t refilledBytes() const override {
+      return (disableFrees && !useFixedBuffer) ? _region->refilledBytes() : 0;
+    }
+    bool untouched(void * ptr) const override {
+      return disableFrees && !useFixedBuffer && !sites && _region->untouched(ptr);
+    }
+    cheap_base * enclosing() const override {
+      return _previous;
+    }
     inline ~cheap() {
+      if (inheritThreads) {
+	releaseChildren();
+      }
       if (disableFrees) {
 	if (!useFixedBuffer) {
-	  getRegion()->clear();
+	  _region->clear();
+	} else {
+	  theOwnerMap().removeFixed(_fixedRange);
 	}
       } else {
-	getFreelist()->clear();
+	_freelist->clear();
       }
       in_cheap = false;
+      if (!_isChild) {
+	// Don't leave current() pointing at a dead scope.
+	current() = _previous;
+	CHEAP_PROBE1(scope_end, this);
+	scopeClosed(this);
+      }
     }
   private:
 
+    class inherited_t {};
+
+    /// Constructs a sub-arena over its own heaps; does not touch current().
+    inline cheap(inherited_t,
+		 size_t sz,
+		 CheapRegionHeap * region,
+		 CheapFreelistHeap * freelist)
+      : _region (region),
+	_freelist (freelist)
+    {
+      _oneSize = sz;
+      _buf = nullptr;
+      _isChild = true;
+      if (disableFrees && !(sizeTaken || allSameSize)) {
+	bump = _region;
+      }
+      if (!disableFrees) {
+	cache_size = _oneSize;
+	freelist = _freelist;
+      }
+      in_cheap = true;
+    }
+
+    class child;
+
+    void __attribute__((noinline)) releaseChildren() {
+      _childLock.lock();
+      auto * c = _children;
+      _children = nullptr;
+      _childLock.unlock();
+      while (c) {
+	auto * next = c->next;
+	c->~child();
+	HL::MmapWrapper::unmap(c, sizeof(child));
+	c = next;
+      }
+    }
+
     static inline CheapRegionHeap * getRegion() {
       //      return nullptr;
       static CheapRegionHeap region;
@@ -194,15 +600,136 @@ namespace cheap {
       return &freelist;
     }
 
+    CheapRegionHeap * _region;
+    CheapFreelistHeap * _freelist;
     size_t _oneSize {0};
     char * _buf;
-    size_t _bufSz;
+    owner_map::fixed_range _fixedRange;
+    cheap_base * _previous {nullptr};
+    bool _isChild {false};
+    child * _children {nullptr};
+    spin_lock _childLock;
+  };
+
+  /// The private heaps (and scope) handed to one inheriting thread.
+  template <const int Flags>
+  class cheap<Flags>::child {
+  public:
+    child(size_t sz)
+      : scope (typename child_scope::inherited_t(), sz, &region, &freelist)
+    {}
+    CheapRegionHeap region;
+    CheapFreelistHeap freelist;
+    child_scope scope;
+    child * next {nullptr};
+  };
+ 
+
+  /// A region that is not tied to a C++ scope: make it the current
+  /// allocation target with cheap::use(), switch to another arena, and
+  /// resume it later with its contents intact. Frees are no-ops; all of
+  /// its memory is dropped at once by clear() or when it is destroyed.
+  /// An arena must only be used by one thread at a time.
+  class arena : public cheap_base {
+  public:
+    inline arena(size_t initialChunkSize = CheapRegionHeap::defaultChunkSize())
+      : _region (initialChunkSize)
+    {
+      in_cheap = true;
+    }
+
+    inline ~arena() {
+      in_cheap = false;
+      if (current() == this) {
+	current() = nullptr;
+      }
+    }
+
+    inline __attribute__((always_inline)) void * malloc(size_t req_sz) {
+      size_t sz = req_sz;
+      if (sz < MIN_ALIGNMENT) {
+	sz = MIN_ALIGNMENT;
+      }
+      sz = (sz + MIN_ALIGNMENT - 1) & ~(MIN_ALIGNMENT - 1);
+      auto ptr = _region.malloc(sz + sizeof(cheap_header));
+      if (!ptr) {
+	return nullptr;
+      }
+      // Always track sizes, so realloc works on arena memory.
+      new (ptr) cheap_header(sz);
+      return (cheap_header *) ptr + 1;
+    }
+
+    inline void free(void *) {
+#if USE_SCOPE_STATS
+      instance->ignoredFrees++;
+#endif
+    }
+
+    inline size_t getSize(void * ptr) {
+      return ((cheap_header *) ptr - 1)->object_size;
+    }
+
+    uint64_t refills() const override {
+      return _region.refills();
+    }
+
+    uint64_t refilledBytes() const override {
+      return _region.refilledBytes();
+    }
+
+    bool untouched(void * ptr) const override {
+      return _region.untouched(ptr);
+    }
+
+    /// Release everything allocated from this arena.
+    inline void clear() {
+      _region.clear();
+    }
+
+    typedef CheapRegionHeap::Mark mark_type;
+
+    /// Remember the current allocation position...
+    inline mark_type mark() const {
+      return _region.mark();
+    }
+
+    /// ...and release everything allocated since then.
+    inline void rewind(const mark_type& m) {
+      _region.rewind(m);
+    }
+
+  private:
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+
+    CheapRegionHeap _region;
   };
 
+  /// Make the given scope or arena (or nullptr, for the system heap) the
+  /// allocation target for this thread, returning the previous one so it
+  /// can be resumed later.
+  inline cheap_base * use(cheap_base * target) {
+    auto * previous = current();
+    current() = target;
+    return previous;
+  }
+
+  inline cheap_base * use(arena& a) {
+    return use(&a);
+  }
  
 } // namespace cheap
 
+#if USE_COMPRESSED_PTRS
+#include "compressed.h"
+#endif
+
+#if USE_GENERAL_HEAP
+class ParentHeap : public GeneralHeap {};
 
+class CustomHeapType : public ParentHeap {};
+#else
 class ParentHeap : public NextHeap {};
 
 class CustomHeapType : public ParentHeap {
@@ -210,19 +737,6 @@ public:
   void lock() {}
   void unlock() {}
 };
-
-class spin_lock {
-public:
-  void lock() {
-    while (_lock.test_and_set(std::memory_order_acquire))
-      ;
-  }
-  void unlock()
-  {
-    _lock.clear(std::memory_order_release);
-  }
-private:
-  std::atomic_flag _lock = ATOMIC_FLAG_INIT;
-};
+#endif
 
 #endif
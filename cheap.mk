@@ -4,7 +4,26 @@ LIBNAME = cheap
 
 include heaplayers-make.mk
 
-.PHONY: format test
+# Call-site colocation (cheap::cheap::colocate_by_site) walks libcheap's
+# own frames.
+CPPFLAGS += -fno-omit-frame-pointer
+
+.PHONY: format test static variant
+
+# lib$(LIBNAME)-$(VARIANT).so: the same library built with extra
+# VARIANT_FLAGS (used by the tests), e.g.
+#   make -f cheap.mk variant VARIANT=sizecache VARIANT_FLAGS=-DUSE_SIZE_CACHES=1
+variant: Heap-Layers $(LINUX_SRC)
+	$(subst -o lib$(LIBNAME).so,-o lib$(LIBNAME)-$(VARIANT).so,$(LINUX_COMPILE)) $(VARIANT_FLAGS)
+
+# libcheap.a: link it into the executable (with -Wl,--whole-archive and
+# -DCHEAP_STATIC=1) to avoid the PLT hop on every allocation. Build with
+# AR=llvm-ar when CPPFLAGS includes -flto.
+STATIC_COMPILE = $(CXX) $(CPPFLAGS) -DCHEAP_STATIC=1 -D'CUSTOM_PREFIX(x)=xx\#\#x' -pipe $(INCLUDES) -D_REENTRANT=1 -c $(LINUX_SRC)
+
+static: Heap-Layers $(LINUX_SRC)
+	$(STATIC_COMPILE)
+	$(AR) rcs lib$(LIBNAME).a $(LINUX_SRC:.cpp=.o)
 
 format: $(SOURCES)
 	clang-format -i $(SOURCES)
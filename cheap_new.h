@@ -0,0 +1,111 @@
+/* -*- C++ -*- */
+
+#pragma once
+
+#ifndef CHEAP_NEW_H
+#define CHEAP_NEW_H
+
+/*
+  Replacement operator new/delete for header-only builds.
+
+  Compile every file with -DCHEAP_HEADER_ONLY=1 and include this header
+  in exactly one of them. Inside a scope, new then bumps the scope's
+  region directly (no PLT, no libcheap); with LTO, the whole path is
+  inlined into each call site. Outside a scope, and for memory the
+  scope does not own, requests go to the system malloc/free.
+
+  Only operator new/delete are captured: malloc/free and thread
+  creation are not interposed in this mode.
+*/
+
+#include <new>
+
+#include "cheap.h"
+
+#if !CHEAP_HEADER_ONLY
+#error "cheap_new.h is for CHEAP_HEADER_ONLY builds; libcheap already replaces operator new."
+#endif
+
+namespace cheap {
+
+  inline __attribute__((always_inline)) void * new_malloc(size_t sz) {
+    auto ci = current();
+#if USE_SCOPE_STATS
+    if (ci) {
+      count_malloc(ci, sz);
+    }
+#endif
+    if (likely(ci && ci->in_cheap) && ci->captures()) {
+      if (unlikely(ci->sites != nullptr)) {
+	// Inlined into operator new, so this is the caller of new.
+	return site_malloc(ci, (uintptr_t) __builtin_return_address(0), sz);
+      }
+      return scope_malloc(ci, sz);
+    }
+    return ::malloc(sz);
+  }
+
+  inline __attribute__((always_inline)) void new_free(void * ptr) {
+    auto ci = current();
+    auto tag = theOwnerMap().tag(ptr);
+    bool owned = (tag == owner_map::Scope);
+    if (ci && ci->in_cheap && owned) {
+      if (frees_to(ci, ptr)) {
+	ci->free(ptr);
+      }
+    } else if (!owned && (tag != owner_map::Dead)) {
+      ::free(ptr);
+    }
+  }
+
+}
+
+void * operator new(size_t sz) {
+  auto ptr = cheap::new_malloc(sz);
+  if (unlikely(ptr == nullptr)) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void * operator new[](size_t sz) {
+  auto ptr = cheap::new_malloc(sz);
+  if (unlikely(ptr == nullptr)) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void * operator new(size_t sz, const std::nothrow_t&) noexcept {
+  return cheap::new_malloc(sz);
+}
+
+void * operator new[](size_t sz, const std::nothrow_t&) noexcept {
+  return cheap::new_malloc(sz);
+}
+
+void operator delete(void * ptr) noexcept {
+  cheap::new_free(ptr);
+}
+
+void operator delete[](void * ptr) noexcept {
+  cheap::new_free(ptr);
+}
+
+void operator delete(void * ptr, size_t) noexcept {
+  cheap::new_free(ptr);
+}
+
+void operator delete[](void * ptr, size_t) noexcept {
+  cheap::new_free(ptr);
+}
+
+void operator delete(void * ptr, const std::nothrow_t&) noexcept {
+  cheap::new_free(ptr);
+}
+
+void operator delete[](void * ptr, const std::nothrow_t&) noexcept {
+  cheap::new_free(ptr);
+}
+
+#endif
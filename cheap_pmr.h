@@ -0,0 +1,206 @@
+/* -*- C++ -*- */
+
+#pragma once
+
+#ifndef CHEAP_PMR_H
+#define CHEAP_PMR_H
+
+/*
+  std::pmr::memory_resource adapters over the cheap engines.
+
+  These let a single container (or any code that takes a
+  std::pmr::polymorphic_allocator) use a region or freelist directly:
+  no interposition of malloc, no TLS lookup and no scope dispatch per
+  call, and no need to link libcheap. Like the std::pmr "unsynchronized"
+  resources, none of these are thread-safe.
+
+    cheap::monotonic_resource mr;
+    std::pmr::vector<int> v(&mr);
+*/
+
+#include <memory_resource>
+#include <new>
+
+#include "cheap.h"
+
+namespace cheap {
+
+  // The same layers as CheapRegionHeap and CheapFreelistHeap, but over
+  // plain mmap: resources never see free(), so their memory does not
+  // need to be registered in libcheap's owner map.
+
+  class ResourceTopHeap : public SizeHeap<ZoneHeap<SizedMmapHeap, 65536>> {};
+
+  class ResourceRegionHeap :
+    public RegionHeap<KingsleyHeap<AdaptHeap<DLList, ResourceTopHeap>, ResourceTopHeap>, 2, 1, 3 * 1048576> {
+  public:
+    using RegionHeap::RegionHeap;
+  };
+
+  class ResourceFreelistHeap :
+    public FreelistHeap<ZoneHeap<SizedMmapHeap, 4096>> {};
+
+  /// Rounds a request up to MIN_ALIGNMENT.
+  inline size_t resource_size(size_t bytes) {
+    if (bytes < MIN_ALIGNMENT) {
+      bytes = MIN_ALIGNMENT;
+    }
+    return (bytes + MIN_ALIGNMENT - 1) & ~(MIN_ALIGNMENT - 1);
+  }
+
+  /// Bump-allocates from a region; deallocate is a no-op and release()
+  /// (or destruction) frees everything at once.
+  class monotonic_resource : public std::pmr::memory_resource {
+  public:
+    explicit monotonic_resource(size_t initialChunkSize = ResourceRegionHeap::defaultChunkSize())
+      : _region (initialChunkSize)
+    {}
+
+    monotonic_resource(const monotonic_resource&) = delete;
+    monotonic_resource& operator=(const monotonic_resource&) = delete;
+
+    void release() {
+      _region.clear();
+    }
+
+  protected:
+    void * do_allocate(size_t bytes, size_t alignment) override {
+      void * ptr;
+      if (alignment <= MIN_ALIGNMENT) {
+	ptr = _region.malloc(resource_size(bytes));
+      } else {
+	// Over-allocate and align within the block.
+	auto * buf = (char *) _region.malloc(resource_size(bytes + alignment));
+	ptr = buf ? (void *) (((uintptr_t) buf + alignment - 1) & ~(uintptr_t) (alignment - 1)) : nullptr;
+      }
+      if (!ptr) {
+	throw std::bad_alloc();
+      }
+      return ptr;
+    }
+
+    void do_deallocate(void *, size_t, size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+      return this == &other;
+    }
+
+  private:
+    ResourceRegionHeap _region;
+  };
+
+  /// Power-of-two size classes, each a freelist. Requests larger than
+  /// the largest class (or more aligned than MIN_ALIGNMENT) go upstream.
+  class pool_resource : public std::pmr::memory_resource {
+  public:
+    enum { NumClasses = 8 }; // MIN_ALIGNMENT bytes up to 128x that
+
+    explicit pool_resource(std::pmr::memory_resource * upstream = std::pmr::get_default_resource())
+      : _upstream (upstream)
+    {}
+
+    pool_resource(const pool_resource&) = delete;
+    pool_resource& operator=(const pool_resource&) = delete;
+
+    /// Return all pooled memory to the OS. Memory obtained from the
+    /// upstream resource must still be deallocated by its owners.
+    void release() {
+      for (auto& c : _classes) {
+	c.~ResourceFreelistHeap();
+	new (&c) ResourceFreelistHeap;
+      }
+    }
+
+    static constexpr size_t largestClass() {
+      return (size_t) MIN_ALIGNMENT << (NumClasses - 1);
+    }
+
+  protected:
+    void * do_allocate(size_t bytes, size_t alignment) override {
+      if ((bytes > largestClass()) || (alignment > MIN_ALIGNMENT)) {
+	return _upstream->allocate(bytes, alignment);
+      }
+      auto c = sizeClass(bytes);
+      void * ptr = _classes[c].malloc((size_t) MIN_ALIGNMENT << c);
+      if (!ptr) {
+	throw std::bad_alloc();
+      }
+      return ptr;
+    }
+
+    void do_deallocate(void * ptr, size_t bytes, size_t alignment) override {
+      if ((bytes > largestClass()) || (alignment > MIN_ALIGNMENT)) {
+	_upstream->deallocate(ptr, bytes, alignment);
+	return;
+      }
+      _classes[sizeClass(bytes)].free(ptr);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+      return this == &other;
+    }
+
+  private:
+    static inline int sizeClass(size_t bytes) {
+      int c = 0;
+      size_t sz = MIN_ALIGNMENT;
+      while (sz < bytes) {
+	sz <<= 1;
+	c++;
+      }
+      return c;
+    }
+
+    std::pmr::memory_resource * _upstream;
+    ResourceFreelistHeap _classes[NumClasses];
+  };
+
+  /// Bump-allocates from a caller-supplied buffer, then spills into a
+  /// region once the buffer is exhausted. Nothing is freed until
+  /// release() or destruction.
+  class buffer_resource : public std::pmr::memory_resource {
+  public:
+    buffer_resource(void * buf, size_t bufSz)
+      : _buf ((char *) buf),
+	_current ((char *) buf),
+	_end ((char *) buf + bufSz)
+    {}
+
+    buffer_resource(const buffer_resource&) = delete;
+    buffer_resource& operator=(const buffer_resource&) = delete;
+
+    void release() {
+      _current = _buf;
+      _spill.release();
+    }
+
+  protected:
+    void * do_allocate(size_t bytes, size_t alignment) override {
+      if (alignment < MIN_ALIGNMENT) {
+	alignment = MIN_ALIGNMENT;
+      }
+      auto * ptr = (char *) (((uintptr_t) _current + alignment - 1) & ~(uintptr_t) (alignment - 1));
+      auto sz = resource_size(bytes);
+      if (likely((ptr >= _current) && (sz <= (size_t) (_end - ptr)))) {
+	_current = ptr + sz;
+	return ptr;
+      }
+      return _spill.allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void *, size_t, size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+      return this == &other;
+    }
+
+  private:
+    char * _buf;
+    char * _current;
+    char * _end;
+    monotonic_resource _spill;
+  };
+
+}
+
+#endif
@@ -112,6 +112,10 @@ class Cheaper:
                 outputstr += ", " + str(list(item["sizes"])[0])
             outputstr += "> reg;"
             print(outputstr)
+            # The same scope for C code, via the C API in cheap.h.
+            c_flags = " | ".join(f.replace("cheap::", "CHEAP_") for f in flag_list)
+            size_hint = str(list(item["sizes"])[0]) if len(item["sizes"]) == 1 else "0"
+            print("C: cheap_handle_t reg = cheap_begin(" + c_flags + ", " + size_hint + "); /* ... */ cheap_end(reg);")
             print("=====\n")
 
     @staticmethod
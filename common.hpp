@@ -3,6 +3,8 @@
 #ifndef COMMON_HPP
 #define COMMON_HPP
 
+#include <atomic>
+
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
@@ -16,7 +18,56 @@
 #define CACHELINE_ALIGNED_FN CACHELINE_ALIGNED
 
 
+class spin_lock {
+public:
+  void lock() {
+    while (_lock.test_and_set(std::memory_order_acquire))
+      ;
+  }
+  void unlock()
+  {
+    _lock.clear(std::memory_order_release);
+  }
+private:
+  std::atomic_flag _lock = ATOMIC_FLAG_INIT;
+};
+
+// Provide cheap::compressed_region and cheap::offset_ptr (compressed.h).
+#if !defined(USE_COMPRESSED_PTRS)
 #define USE_COMPRESSED_PTRS 0
-#define USE_SIZE_CACHES 0 // 1
+#endif
+
+// Put a per-thread cache of small freed objects (sizecache.h) in front
+// of the custom heap and of freelist scopes.
+#if !defined(USE_SIZE_CACHES)
+#define USE_SIZE_CACHES 0
+#endif
+
+// Count allocations, bytes, region refills and ignored frees per scope
+// (see cheap::stats); without it, the counters are compiled out.
+// libcheap and the code using scopes should agree on this setting.
+#if !defined(USE_SCOPE_STATS)
+#define USE_SCOPE_STATS 0
+#endif
+
+// Serve requests outside of scopes from GeneralHeap (generalheap.h)
+// instead of forwarding them to the next allocator.
+#if !defined(USE_GENERAL_HEAP)
+#define USE_GENERAL_HEAP 0
+#endif
+
+// Have libcheap export the -finstrument-functions hooks that open the
+// scopes listed in CHEAP_SCOPES or CHEAP_CONFIG (see scopeconfig.h).
+// Off by default, since every instrumented program that loads libcheap
+// would then call into it on each function entry and exit.
+#if !defined(USE_CONFIGURED_SCOPES)
+#define USE_CONFIGURED_SCOPES 0
+#endif
+
+// Compile in the USDT probes of probes.h (nops unless a tracer
+// attaches).
+#if !defined(USE_PROBES)
+#define USE_PROBES 1
+#endif
 
 #endif
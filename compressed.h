@@ -0,0 +1,318 @@
+/* -*- C++ -*- */
+
+#pragma once
+
+#ifndef COMPRESSED_H
+#define COMPRESSED_H
+
+/*
+  Arena-relative compressed pointers (enabled by USE_COMPRESSED_PTRS).
+
+  A cheap::compressed_region is a region scope that keeps everything it
+  allocates inside one 4GB reservation, aligned to 4GB. A
+  cheap::offset_ptr<T> stored in that memory is then just the 32-bit
+  offset of its target from the reservation's base, which it recovers
+  from its own address, so pointer-heavy nodes shrink by up to half:
+
+    struct node {
+      int value;
+      cheap::offset_ptr<node> next;  // 4 bytes, not 8
+    };
+
+    cheap::compressed_region reg;
+    auto * head = new node { 1, nullptr };
+    head->next = new node { 2, nullptr };
+
+  offset_ptrs must live in the same compressed region as their
+  targets; use ordinary pointers everywhere else (e.g., on the stack).
+  offset_ptrs cannot be copy-constructed (a copy is rarely in the same
+  region); read them into a T * instead:
+
+    node * next = head->next;
+*/
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+namespace cheap {
+
+  /// A bump allocator over a single 4GB-aligned 4GB reservation, made
+  /// accessible (and registered in theOwnerMap()) one CommitSize step
+  /// at a time. The top of the reservation holds a bitmap of where
+  /// objects start, which gives their sizes. Not thread-safe.
+  class CompressedRegionHeap {
+  public:
+
+    enum { Alignment = MIN_ALIGNMENT };
+    enum { CommitSize = 1048576 };
+    static constexpr size_t ReservationSize = (size_t) 1 << 32;
+    /// One bit per Alignment bytes.
+    static constexpr size_t BitmapSize = ReservationSize / Alignment / 8;
+    static constexpr size_t DataSize = ReservationSize - BitmapSize;
+
+    CompressedRegionHeap()
+      : _base (nullptr),
+	_current (nullptr),
+	_committed (nullptr),
+	_bitmapCommitted (0)
+    {
+      if (!reuse()) {
+	_base = reserve();
+	_committed = _base;
+      }
+      if (_base) {
+	_current = _base + Alignment; // offset 0 means null
+      }
+    }
+
+    /// Keeps the reservation, with its memory released and tagged Dead,
+    /// for the next compressed region: objects that outlive this one
+    /// may still be freed.
+    ~CompressedRegionHeap() {
+      if (!_base) {
+	return;
+      }
+      if (_committed == _base) {
+	munmap(_base, ReservationSize);
+	return;
+      }
+      clear();
+      theOwnerMap().set(_base, _committed - _base, owner_map::Dead);
+      auto * r = (reservation *) _base;
+      r->committed = _committed;
+      r->bitmapCommitted = _bitmapCommitted;
+      poolLock().lock();
+      r->next = pool();
+      pool() = r;
+      poolLock().unlock();
+    }
+
+    /// Assumes sz is a multiple of Alignment.
+    inline void * __attribute__((always_inline)) malloc(size_t sz) {
+      if (unlikely(_current + sz > _committed)) {
+	if (!commit(sz)) {
+	  return nullptr;
+	}
+      }
+      auto * ptr = _current;
+      auto g = granule(ptr);
+      bitmap()[g / 64] |= (uint64_t) 1 << (g % 64);
+      _current += sz;
+      return ptr;
+    }
+
+    /// The size of the object at ptr: up to the next object's start.
+    size_t getSize(const void * ptr) const {
+      auto first = granule(ptr);
+      auto end = granule(_current);
+      auto g = first + 1;
+      while (g < end) {
+	auto word = bitmap()[g / 64] >> (g % 64);
+	if (word) {
+	  g += __builtin_ctzll(word);
+	  break;
+	}
+	g = (g / 64 + 1) * 64;
+      }
+      if (g > end) {
+	g = end;
+      }
+      return (g - first) * Alignment;
+    }
+
+    /// Release everything, keeping the reservation.
+    void clear() {
+      if (_base) {
+	madvise(_base, _committed - _base, MADV_DONTNEED);
+	madvise(bitmap(), _bitmapCommitted, MADV_DONTNEED);
+	_current = _base + Alignment;
+      }
+    }
+
+    static inline char * baseOf(const void * ptr) {
+      return (char *) ((uintptr_t) ptr & ~(uintptr_t) (ReservationSize - 1));
+    }
+
+  private:
+
+    CompressedRegionHeap(const CompressedRegionHeap&) = delete;
+    CompressedRegionHeap& operator=(const CompressedRegionHeap&) = delete;
+
+    /// A released reservation, recorded at its base.
+    class reservation {
+    public:
+      reservation * next;
+      char * committed;
+      size_t bitmapCommitted;
+    };
+
+    static reservation *& pool() {
+      static reservation * p = nullptr;
+      return p;
+    }
+
+    static spin_lock& poolLock() {
+      static spin_lock l;
+      return l;
+    }
+
+    /// Take a released reservation, if there is one.
+    bool reuse() {
+      poolLock().lock();
+      auto * r = pool();
+      if (r) {
+	pool() = r->next;
+      }
+      poolLock().unlock();
+      if (!r) {
+	return false;
+      }
+      _base = (char *) r;
+      _committed = r->committed;
+      _bitmapCommitted = r->bitmapCommitted;
+      memset(r, 0, sizeof(reservation));
+      theOwnerMap().add(_base, _committed - _base, (uintptr_t) this);
+      return true;
+    }
+
+    inline uint64_t * bitmap() const {
+      return (uint64_t *) (_base + DataSize);
+    }
+
+    inline size_t granule(const void * ptr) const {
+      return ((const char *) ptr - _base) / Alignment;
+    }
+
+    /// Reserve (but do not commit) a 4GB-aligned 4GB range.
+    static char * reserve() {
+      auto * buf = (char *) mmap(nullptr, 2 * ReservationSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (buf == MAP_FAILED) {
+	return nullptr;
+      }
+      auto * aligned = baseOf(buf + ReservationSize - 1);
+      if (aligned > buf) {
+	munmap(buf, aligned - buf);
+      }
+      munmap(aligned + ReservationSize, (buf + 2 * ReservationSize) - (aligned + ReservationSize));
+      return aligned;
+    }
+
+    bool __attribute__((noinline)) commit(size_t sz) {
+      if (!_base || (sz > (size_t) (_base + DataSize - _current))) {
+	return false;
+      }
+      auto needed = (size_t) (_current + sz - _committed);
+      needed = (needed + CommitSize - 1) & ~((size_t) CommitSize - 1);
+      if (needed > (size_t) (_base + DataSize - _committed)) {
+	needed = _base + DataSize - _committed;
+      }
+      // The bitmap covering the new memory, in whole pages.
+      auto bits = ((size_t) (_committed + needed - _base) / Alignment / 8 + 4095) & ~(size_t) 4095;
+      if ((bits > _bitmapCommitted) &&
+	  (mprotect((char *) bitmap() + _bitmapCommitted, bits - _bitmapCommitted, PROT_READ | PROT_WRITE) != 0)) {
+	return false;
+      }
+      if (bits > _bitmapCommitted) {
+	_bitmapCommitted = bits;
+      }
+      if (mprotect(_committed, needed, PROT_READ | PROT_WRITE) != 0) {
+	return false;
+      }
+      theOwnerMap().add(_committed, needed, (uintptr_t) this);
+      _committed += needed;
+      return true;
+    }
+
+    char * _base;
+    char * _current;
+    char * _committed;
+    /// Bytes of the bitmap made accessible so far.
+    size_t _bitmapCommitted;
+  };
+
+  /// A region scope whose memory all lies in one CompressedRegionHeap.
+  /// Like other region scopes, frees are no-ops; sizes are kept (for
+  /// realloc and malloc_usable_size).
+  class compressed_region : public cheap_base {
+  public:
+    inline compressed_region() {
+      _previous = current();
+      current() = this;
+      in_cheap = true;
+    }
+
+    inline ~compressed_region() {
+      in_cheap = false;
+      current() = _previous;
+    }
+
+    inline __attribute__((always_inline)) void * malloc(size_t sz) {
+      if (sz < MIN_ALIGNMENT) {
+	sz = MIN_ALIGNMENT;
+      }
+      return _region.malloc((sz + MIN_ALIGNMENT - 1) & ~(MIN_ALIGNMENT - 1));
+    }
+
+    inline void free(void *) {}
+
+    inline size_t getSize(void * ptr) {
+      return _region.getSize(ptr);
+    }
+
+  private:
+    compressed_region(const compressed_region&) = delete;
+    compressed_region& operator=(const compressed_region&) = delete;
+
+    CompressedRegionHeap _region;
+    cheap_base * _previous;
+  };
+
+  /// A 32-bit pointer to an object in the same compressed_region as the
+  /// offset_ptr itself.
+  template <typename T>
+  class offset_ptr {
+  public:
+    offset_ptr() : _offset (0) {}
+    offset_ptr(std::nullptr_t) : _offset (0) {}
+    offset_ptr(T * ptr) : _offset (encode(ptr)) {}
+    /// A copy would be encoded against wherever it is constructed,
+    /// usually outside the region; copy into a T * instead.
+    offset_ptr(const offset_ptr&) = delete;
+
+    offset_ptr& operator=(T * ptr) {
+      _offset = encode(ptr);
+      return *this;
+    }
+
+    offset_ptr& operator=(const offset_ptr& other) {
+      _offset = encode(other.get());
+      return *this;
+    }
+
+    inline T * get() const {
+      return _offset ? (T *) (CompressedRegionHeap::baseOf(this) + _offset) : nullptr;
+    }
+
+    inline T * operator->() const { return get(); }
+    inline T& operator*() const { return *get(); }
+    inline operator T*() const { return get(); }
+    inline explicit operator bool() const { return _offset != 0; }
+
+  private:
+    inline uint32_t encode(T * ptr) const {
+      if (!ptr) {
+	return 0;
+      }
+      assert(CompressedRegionHeap::baseOf(ptr) == CompressedRegionHeap::baseOf(this));
+      return (uint32_t) ((char *) ptr - CompressedRegionHeap::baseOf(this));
+    }
+
+    uint32_t _offset;
+  };
+
+}
+
+#endif
@@ -0,0 +1,346 @@
+/* -*- C++ -*- */
+
+#pragma once
+
+#ifndef GENERALHEAP_H
+#define GENERALHEAP_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "heaplayers.h"
+
+#include "common.hpp"
+#include "ownership.h"
+
+/**
+ * A general-purpose heap for requests made outside of any scope (see
+ * USE_GENERAL_HEAP in common.hpp).
+ *
+ * Small objects are rounded up to one of NumClasses size classes (four
+ * per power of two) and served from per-thread caches, which exchange
+ * batches of objects with a global central heap. The central heap
+ * carves 64K runs out of 2MB huge-page-aligned spans; each run holds
+ * objects of one class, and the class is recorded as the run's pages'
+ * tag in theOwnerMap(), so frees need no headers. Large objects are
+ * mapped individually. Spans are never returned to the OS.
+ */
+class GeneralHeap {
+public:
+
+  enum { Alignment = alignof(max_align_t) };
+  enum { NumClasses = 40 };
+  enum { MaxSmall = 32768 };
+  enum { RunSize = 65536 };
+  enum { SpanSize = 2 * 1048576 };
+  enum { BatchSize = 32 };
+  enum { MaxCached = 2 * BatchSize };
+
+  // Page tags (after those reserved by cheap::owner_map).
+  enum { FirstClassTag = cheap::owner_map::FirstFreeTag };
+  enum { LargeTag = FirstClassTag + NumClasses };
+
+  static_assert(LargeTag < 256, "Page tags must fit in a byte.");
+
+  inline void * malloc(size_t sz) {
+    if (likely(sz <= MaxSmall)) {
+      return mallocClass(sizeClass(sz));
+    }
+    return largeMalloc(sz, Alignment);
+  }
+
+  inline void * memalign(size_t alignment, size_t sz) {
+    if (alignment <= Alignment) {
+      return malloc(sz);
+    }
+    // Power-of-two classes are naturally aligned within their runs.
+    size_t pow2 = (sz < alignment) ? alignment : sz;
+    if ((pow2 <= MaxSmall) && (alignment <= RunSize)) {
+      pow2 = (size_t) 1 << (64 - __builtin_clzl(pow2 - 1));
+      return mallocClass(sizeClass(pow2));
+    }
+    return largeMalloc(sz, alignment);
+  }
+
+  inline bool free(void * ptr) {
+    auto tag = theOwnerMap().tag(ptr);
+    if (likely((tag >= FirstClassTag) && (tag < LargeTag))) {
+      auto c = tag - FirstClassTag;
+      auto& cache = threadCache()[c];
+      auto * obj = (object *) ptr;
+      obj->next = cache.head;
+      cache.head = obj;
+      if (unlikely(++cache.count > MaxCached)) {
+	flush(c, BatchSize);
+      }
+      return true;
+    }
+    if (tag == LargeTag) {
+      largeFree(ptr);
+      return true;
+    }
+    // Not ours (e.g., served by the bootstrap heap): ignore.
+    return false;
+  }
+
+  inline size_t getSize(void * ptr) {
+    auto tag = theOwnerMap().tag(ptr);
+    if (likely((tag >= FirstClassTag) && (tag < LargeTag))) {
+      return classSize(tag - FirstClassTag);
+    }
+    if (tag == LargeTag) {
+      return largeHeader(ptr)->size;
+    }
+    return 0;
+  }
+
+  /// Acquire every central lock (e.g., around fork).
+  void lock() {
+    spans().lock.lock();
+    for (int c = 0; c < NumClasses; c++) {
+      centrals()[c].lock.lock();
+    }
+  }
+
+  void unlock() {
+    for (int c = 0; c < NumClasses; c++) {
+      centrals()[c].lock.unlock();
+    }
+    spans().lock.unlock();
+  }
+
+  /// Create the key whose destructor flushes a thread's caches.
+  static void initialize() {
+    if (pthread_key_create(&threadKey(), flushThread) == 0) {
+      keyCreated() = true;
+    }
+  }
+
+  static inline int sizeClass(size_t sz) {
+    if (sz <= 128) {
+      return (sz <= 16) ? 0 : (int) ((sz + 15) / 16) - 1;
+    }
+    int lg = 63 - __builtin_clzl(sz - 1);
+    int quarter = (int) ((sz - 1) >> (lg - 2)) - 4;
+    return 8 + (lg - 7) * 4 + quarter;
+  }
+
+  static inline size_t classSize(int c) {
+    if (c < 8) {
+      return (size_t) (c + 1) * 16;
+    }
+    int lg = 7 + (c - 8) / 4;
+    int quarter = (c - 8) % 4;
+    return (size_t) (5 + quarter) << (lg - 2);
+  }
+
+private:
+
+  class object {
+  public:
+    object * next;
+  };
+
+  class freelist {
+  public:
+    object * head;
+    size_t count;
+  };
+
+  /// The shared pool of objects of one size class.
+  class central {
+  public:
+    spin_lock lock;
+    object * head {nullptr};
+    size_t count {0};
+    char * runPointer {nullptr};
+    char * runEnd {nullptr};
+  };
+
+  class span_source {
+  public:
+    spin_lock lock;
+    char * pointer {nullptr};
+    char * end {nullptr};
+  };
+
+  class large_header {
+  public:
+    void * base;
+    size_t mapped;
+    size_t size;
+    size_t padding;
+  };
+
+  // Constant-initialized, so usable before any constructor runs.
+  static inline central * centrals() {
+    static central c[NumClasses];
+    return c;
+  }
+
+  static inline span_source& spans() {
+    static span_source s;
+    return s;
+  }
+
+  static inline freelist * threadCache() {
+    static __thread freelist cache[NumClasses] __attribute__((tls_model ("initial-exec")));
+    return cache;
+  }
+
+  static inline pthread_key_t& threadKey() {
+    static pthread_key_t key;
+    return key;
+  }
+
+  static inline bool& keyCreated() {
+    static bool created {false};
+    return created;
+  }
+
+  inline void * mallocClass(int c) {
+    auto& cache = threadCache()[c];
+    auto * obj = cache.head;
+    if (likely(obj != nullptr)) {
+      cache.head = obj->next;
+      cache.count--;
+      return obj;
+    }
+    return refill(c);
+  }
+
+  /// Move up to BatchSize objects from the central heap (carving new
+  /// ones as needed) into this thread's cache, and return one of them.
+  void * __attribute__((noinline)) refill(int c) {
+    static __thread bool registered __attribute__((tls_model ("initial-exec")));
+    if (unlikely(!registered && keyCreated())) {
+      registered = true;
+      pthread_setspecific(threadKey(), (void *) 1);
+    }
+    auto& cache = threadCache()[c];
+    auto& ctr = centrals()[c];
+    auto sz = classSize(c);
+    ctr.lock.lock();
+    int got = 0;
+    while ((got < BatchSize) && ctr.head) {
+      auto * obj = ctr.head;
+      ctr.head = obj->next;
+      ctr.count--;
+      obj->next = cache.head;
+      cache.head = obj;
+      got++;
+    }
+    while (got < BatchSize) {
+      if ((size_t) (ctr.runEnd - ctr.runPointer) < sz) {
+	auto * run = newRun();
+	if (!run) {
+	  break;
+	}
+	theOwnerMap().set(run, RunSize, FirstClassTag + c);
+	ctr.runPointer = run;
+	ctr.runEnd = run + RunSize;
+      }
+      auto * obj = (object *) ctr.runPointer;
+      ctr.runPointer += sz;
+      obj->next = cache.head;
+      cache.head = obj;
+      got++;
+    }
+    ctr.lock.unlock();
+    cache.count += got;
+    return mallocClassCached(c);
+  }
+
+  inline void * mallocClassCached(int c) {
+    auto& cache = threadCache()[c];
+    auto * obj = cache.head;
+    if (!obj) {
+      return nullptr;
+    }
+    cache.head = obj->next;
+    cache.count--;
+    return obj;
+  }
+
+  /// Return up to n objects from this thread's cache to the central heap.
+  static void __attribute__((noinline)) flush(int c, size_t n) {
+    auto& cache = threadCache()[c];
+    auto& ctr = centrals()[c];
+    ctr.lock.lock();
+    while (n-- && cache.head) {
+      auto * obj = cache.head;
+      cache.head = obj->next;
+      cache.count--;
+      obj->next = ctr.head;
+      ctr.head = obj;
+      ctr.count++;
+    }
+    ctr.lock.unlock();
+  }
+
+  static void flushThread(void *) {
+    for (int c = 0; c < NumClasses; c++) {
+      flush(c, (size_t) -1);
+    }
+  }
+
+  static char * newRun() {
+    auto& s = spans();
+    s.lock.lock();
+    if (s.pointer == s.end) {
+      // Map twice the span size, so we can trim to an aligned span.
+      auto * buf = (char *) HL::MmapWrapper::map(2 * SpanSize);
+      if (!buf) {
+	s.lock.unlock();
+	return nullptr;
+      }
+      auto * aligned = (char *) (((uintptr_t) buf + SpanSize - 1) & ~((uintptr_t) SpanSize - 1));
+      if (aligned > buf) {
+	HL::MmapWrapper::unmap(buf, aligned - buf);
+      }
+      HL::MmapWrapper::unmap(aligned + SpanSize, (buf + 2 * SpanSize) - (aligned + SpanSize));
+#if defined(MADV_HUGEPAGE)
+      madvise(aligned, SpanSize, MADV_HUGEPAGE);
+#endif
+      s.pointer = aligned;
+      s.end = aligned + SpanSize;
+    }
+    auto * run = s.pointer;
+    s.pointer += RunSize;
+    s.lock.unlock();
+    return run;
+  }
+
+  static inline large_header * largeHeader(void * ptr) {
+    return (large_header *) ptr - 1;
+  }
+
+  static void * largeMalloc(size_t sz, size_t alignment) {
+    size_t mapped = sz + sizeof(large_header) + alignment;
+    if (mapped < sz) {
+      return nullptr;
+    }
+    auto * base = (char *) HL::MmapWrapper::map(mapped);
+    if (!base) {
+      return nullptr;
+    }
+    auto * ptr = (char *) (((uintptr_t) base + sizeof(large_header) + alignment - 1) & ~((uintptr_t) alignment - 1));
+    auto * h = largeHeader(ptr);
+    h->base = base;
+    h->mapped = mapped;
+    h->size = sz;
+    theOwnerMap().set(base, mapped, LargeTag);
+    return ptr;
+  }
+
+  static void largeFree(void * ptr) {
+    auto * h = largeHeader(ptr);
+    auto * base = h->base;
+    auto mapped = h->mapped;
+    theOwnerMap().remove(base, mapped);
+    HL::MmapWrapper::unmap(base, mapped);
+  }
+};
+
+#endif
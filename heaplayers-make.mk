@@ -9,7 +9,7 @@ MACOS_SRC = lib$(LIBNAME).cpp printf.cpp Heap-Layers/wrappers/macwrapper.cpp
 MACOS_COMPILE = $(CXX) -ftls-model=initial-exec -ftemplate-depth=1024 -pipe $(CPPFLAGS) $(INCLUDES) -D_REENTRANT=1 -compatibility_version 1 -current_version 1 -D'CUSTOM_PREFIX(x)=xx\#\#x' $(MACOS_SRC) -dynamiclib -install_name $(DESTDIR)$(PREFIX)/lib$(LIBNAME).dylib -o lib$(LIBNAME).dylib -Lvendor/libbacktrace/.libs -lbacktrace -ldl -lpthread
 
 LINUX_SRC = lib$(LIBNAME).cpp printf.cpp # Heap-Layers/wrappers/gnuwrapper.cpp
-LINUX_COMPILE = $(CXX) $(CPPFLAGS) -D'CUSTOM_PREFIX(x)=xx\#\#x' -I/usr/include/nptl -pipe -fPIC $(INCLUDES) -D_REENTRANT=1 -shared $(LINUX_SRC) -Bsymbolic -o lib$(LIBNAME).so -Lvendor/libbacktrace/.libs -lbacktrace -ldl -lpthread
+LINUX_COMPILE = $(CXX) $(CPPFLAGS) -D'CUSTOM_PREFIX(x)=xx\#\#x' -I/usr/include/nptl -pipe -fPIC $(INCLUDES) -D_REENTRANT=1 -shared $(LINUX_SRC) -Bsymbolic -o lib$(LIBNAME).so -Lvendor/libbacktrace/.libs -lbacktrace -ldl -lpthread -lrt
 
 UNAME_S := $(shell uname -s)
 UNAME_P := $(shell uname -p)
@@ -1,33 +1,96 @@
 /*
   libcheap.cpp
      enables easy use of regions
-   invoke `region_begin(...)` --> all subsequent `malloc`s use the buffer,
-  `free`s are ignored
-   invoke `region_end()` --> back to normal `malloc`/`free` behavior
+   invoke `cheap_begin(flags, size_hint)` --> all subsequent `malloc`s
+     on this thread use a custom heap (with CHEAP_DISABLE_FREE, `free`s
+     are ignored)
+   invoke `cheap_end(handle)` --> back to normal `malloc`/`free` behavior
 
-   see the C++ API in cheap.h
+   see cheap.h for the C API and the C++ API (`cheap::cheap<...>`)
 
 */
 
 #include <heaplayers.h>
 
 #include "cheap.h"
+#include "nursery.h"
+#include "scopeconfig.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "printf.h"
+
+#include "livestats.h"
+#include "perfcounters.h"
+#include "tracebuffer.h"
+#include <sys/syscall.h>
+#include <sys/mman.h>
 
 #if defined(__APPLE__)
 #include "macinterpose.h"
 #endif
 
+// For use by the replacement printf routines (see
+// https://github.com/mpaland/printf); this also keeps printf.cpp
+// self-contained when it is linked statically from libcheap.a.
+extern "C" void _putchar(char ch) { ::write(2, (void *)&ch, 1); }
+
 #if defined(__APPLE__)
 #define LOCAL_PREFIX(x) xx##x
 #else
 #define LOCAL_PREFIX(x) x
 #endif
 
+// NextHeap and GeneralHeap keep their state in constant-initialized
+// statics, so this needs no guard variable.
+static CustomHeapType thang;
+
 CustomHeapType &getTheCustomHeap() {
-  static CustomHeapType thang;
   return thang;
 }
 
+#if USE_SIZE_CACHES
+static void initializeSizeCaches();
+#endif
+static void initializeCallSites();
+#if USE_CONFIGURED_SCOPES
+static void loadScopeConfig();
+#endif
+static void initializeScopeStats();
+#if !defined(__APPLE__)
+static void initializeThreads();
+#endif
+
+// Resolve the next allocator at load time rather than on first use.
+__attribute__((constructor)) static void initializeTheCustomHeap() {
+  NextHeap::initialize();
+#if USE_GENERAL_HEAP
+  GeneralHeap::initialize();
+#endif
+#if USE_SIZE_CACHES
+  initializeSizeCaches();
+#endif
+  initializeCallSites();
+  regionGeometry();
+#if USE_CONFIGURED_SCOPES
+  loadScopeConfig();
+#endif
+  initializeScopeStats();
+#if !defined(__APPLE__)
+  initializeThreads();
+#endif
+}
+
+#if CHEAP_STATIC
+
+__attribute__((visibility("default"))) __thread cheap::cheap_base * cheap_current_scope __attribute__((tls_model ("initial-exec")));
+
+#else
+
 class cheap_current {
 private:
   cheap_current();
@@ -50,50 +113,355 @@ __attribute__((visibility("default"))) cheap::cheap_base*& current() {
   return cheap_current::current();
 }
 
+#endif
+
+// Constant-initialized, so it is usable before any constructors run.
+static cheap::owner_map ownerMap;
+
+__attribute__((visibility("default"))) cheap::owner_map& theOwnerMap() {
+  return ownerMap;
+}
+
+/// Read once, at load (see initializeTheCustomHeap).
+__attribute__((visibility("default"))) const cheap::region_geometry& regionGeometry() {
+  static const auto g = cheap::region_geometry::fromEnvironment(CheapRegionBase::defaultGeometry());
+  return g;
+}
+
 #if 1
 #define FLATTEN __attribute__((flatten))
 #else
 #define FLATTEN
 #endif
 
+#if USE_SIZE_CACHES
+
+#include <pthread.h>
+
+static __thread cheap::size_cache sizeCache __attribute__((tls_model ("initial-exec")));
+static __thread bool sizeCacheRegistered __attribute__((tls_model ("initial-exec")));
+static pthread_key_t sizeCacheKey;
+static bool sizeCacheKeyCreated = false;
+
+// Give back any custom-heap objects a thread still holds when it exits.
+static void releaseSizeCache(void *) {
+  sizeCache.reset(getTheCustomHeap());
+}
+
+static void initializeSizeCaches() {
+  sizeCacheKeyCreated = (pthread_key_create(&sizeCacheKey, releaseSizeCache) == 0);
+}
+
+/// The size_cache owner id for ci, assigned on first use.
+static inline uintptr_t cacheOwner(cheap::cheap_base * ci) {
+  static std::atomic<uintptr_t> nextId {1};
+  auto id = __atomic_load_n(&ci->cache_id, __ATOMIC_ACQUIRE);
+  if (unlikely(id == 0)) {
+    uintptr_t fresh = nextId.fetch_add(1);
+    if (__atomic_compare_exchange_n(&ci->cache_id, &id, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      id = fresh;
+    }
+  }
+  return id;
+}
+
+/// Cache a custom-heap object; returns false if it must be freed.
+static inline bool cacheHeapObject(void * ptr) {
+  if (unlikely(!sizeCacheRegistered) && sizeCacheKeyCreated) {
+    sizeCacheRegistered = true;
+    pthread_setspecific(sizeCacheKey, (void *) 1);
+  }
+  return sizeCache.put(0, ptr, getTheCustomHeap().getSize(ptr), getTheCustomHeap());
+}
+
+#endif
+
+// Learns which call sites allocate short-lived objects, in auto mode.
+static cheap::auto_nursery nursery;
+
+// The code of libcheap itself (malloc, operator new, xxmalloc, ...).
+static cheap::site_filter libcheapCode;
+
+static void initializeCallSites() {
+  libcheapCode.add_object((void *) &initializeCallSites);
+  auto * autoMode = getenv("CHEAP_AUTO");
+  nursery.enable(autoMode && (atoi(autoMode) != 0));
+}
+
+/// The first return address outside libcheap: the allocation's call
+/// site. Walks frame pointers, so libcheap is built with them (see
+/// cheap.mk). In static builds, libcheap is part of the executable and
+/// every allocation reports the same site.
+static inline __attribute__((always_inline)) uintptr_t callSite() {
+#if CHEAP_STATIC
+  return 0;
+#else
+  auto ** fp = (void **) __builtin_frame_address(0);
+  for (int i = 0; (i < 8) && fp; i++) {
+    auto ra = (uintptr_t) fp[1];
+    if (!libcheapCode.contains(ra)) {
+      return ra;
+    }
+    auto ** next = (void **) fp[0];
+    if (next <= fp) {
+      break;
+    }
+    fp = next;
+  }
+  return 0;
+#endif
+}
+
+// Only pointers that live in cheap memory (see ownership.h) go to the
+// active scope; anything else came from the custom heap, whether it
+// was allocated before the scope opened or by another thread.
+
 extern "C" size_t FLATTEN xxmalloc_usable_size(void *ptr) {
   auto ci = current();
-  if (likely(ci && ci->in_cheap)) {
+  auto tag = ownerMap.tag(ptr);
+  if (likely(ci && ci->in_cheap && (tag == cheap::owner_map::Scope))) {
     return ci->getSize(ptr);
   }
+  if (unlikely(tag == cheap::owner_map::Nursery)) {
+    return nursery.getSize(ptr);
+  }
+  if (unlikely(tag == cheap::owner_map::Dead)) {
+    return 0;
+  }
   return getTheCustomHeap().getSize(ptr);
 }
 
-extern "C" void * FLATTEN xxmalloc(size_t req_sz) __attribute__((alloc_size(1))) __attribute((malloc));
+/// Allocate outside any scope.
+static inline __attribute__((always_inline)) void * heapMalloc(size_t sz) {
+#if USE_SIZE_CACHES
+  if (sz <= cheap::size_cache::MaxSize) {
+    auto ptr = sizeCache.get(0, sz);
+    if (ptr) {
+      return ptr;
+    }
+  }
+#endif
+  return getTheCustomHeap().malloc(sz);
+}
+
+/// Allocate outside any scope in auto mode (see nursery.h).
+static void * __attribute__((noinline)) autoMalloc(size_t sz) {
+  auto ptr = nursery.malloc(callSite(), sz);
+  if (ptr) {
+    return ptr;
+  }
+  ptr = heapMalloc(sz);
+  nursery.sampled(ptr);
+  return ptr;
+}
 
-  extern "C" void * FLATTEN xxmalloc(size_t req_sz) {
+/// Free memory that came from the custom heap.
+static inline __attribute__((always_inline)) void heapFree(void * ptr) {
+  if (unlikely(nursery.enabled())) {
+    nursery.heapFree(ptr);
+  }
+#if USE_SIZE_CACHES
+  if (ptr && cacheHeapObject(ptr)) {
+    return;
+  }
+#endif
+  getTheCustomHeap().free(ptr);
+}
+
+// Set when latency or stack sampling is on (see below), so xxmalloc
+// and xxfree test a single flag otherwise.
+static bool instrumenting = false;
+static void * instrumentedMalloc(size_t sz);
+static void instrumentedFree(void * ptr);
+
+static inline __attribute__((always_inline)) void * mallocPath(size_t req_sz) {
   size_t sz = req_sz;
   auto ci = current();
   //  tprintf::tprintf("xxmalloc(@) OH YEAH @\n", sz, ci);
-  if (likely(ci && ci->in_cheap)) {
-    auto ptr = ci->malloc(sz);
+  if (unlikely(ci && ci->instance)) {
+    // Scope counters, kept for all scopes with USE_SCOPE_STATS and for
+    // measured instances otherwise.
+    cheap::count_malloc(ci, sz);
+  }
+  if (likely(ci && ci->in_cheap) && ci->captures()) {
+#if USE_SIZE_CACHES
+    if (ci->cache_size && (sz <= cheap::size_cache::MaxSize)) {
+      auto ptr = sizeCache.get(cacheOwner(ci), sz);
+      if (ptr) {
+	return ptr;
+      }
+    }
+#endif
+    if (unlikely(ci->sites != nullptr)) {
+      return cheap::site_malloc(ci, callSite(), sz);
+    }
+    auto ptr = cheap::scope_malloc(ci, sz);
     //    tprintf::tprintf("region malloc @ = @\n", sz, ptr);
     return ptr;
   }
-  return getTheCustomHeap().malloc(sz);
+  if (unlikely(ci && ci->instance) && !ci->instance->bypassed) {
+    // Made in a scope but served by the heap (filtered out).
+    ci->instance->spills++;
+  }
+  if (ci) {
+    CHEAP_PROBE2(fallback, ci, sz);
+  }
+  if (unlikely(nursery.enabled())) {
+    return autoMalloc(sz);
+  }
+  return heapMalloc(sz);
 }
 
-extern "C" void FLATTEN xxfree(void *ptr) {
+extern "C" void * FLATTEN xxmalloc(size_t req_sz) __attribute__((alloc_size(1))) __attribute((malloc));
+
+extern "C" void * FLATTEN xxmalloc(size_t req_sz) {
+  if (unlikely(instrumenting)) {
+    return instrumentedMalloc(req_sz);
+  }
+  return mallocPath(req_sz);
+}
+
+static inline __attribute__((always_inline)) void freePath(void * ptr) {
   auto ci = current();
+  auto tag = ownerMap.tag(ptr);
+  if (unlikely(tag == cheap::owner_map::Nursery)) {
+    nursery.free(ptr);
+    return;
+  }
+  bool owned = (tag == cheap::owner_map::Scope);
+  // Scope memory freed outside its scope is reclaimed when the scope
+  // ends, and memory of a released heap is Dead; never hand either to
+  // the custom heap.
   if (unlikely(!ci || !ci->in_cheap)) {
-    getTheCustomHeap().free(ptr);
+    if (likely(!owned && (tag != cheap::owner_map::Dead))) {
+      heapFree(ptr);
+    }
+    return;
+  }
+  if (unlikely(!owned)) {
+    if (unlikely(tag == cheap::owner_map::Dead)) {
+      return;
+    }
+    heapFree(ptr);
+    return;
+  }
+  if (unlikely(!cheap::frees_to(ci, ptr, ownerMap))) {
     return;
   }
+#if USE_SIZE_CACHES
+  if (ci->cache_size && sizeCache.put(cacheOwner(ci), ptr, ci->cache_size, getTheCustomHeap())) {
+    return;
+  }
+#endif
   return ci->free(ptr);
 }
 
+extern "C" void FLATTEN xxfree(void *ptr) {
+  if (unlikely(instrumenting)) {
+    return instrumentedFree(ptr);
+  }
+  freePath(ptr);
+}
+
+// Latency sampling (CHEAP_LATENCY=<n>): one xxmalloc/xxfree call in n
+// on each thread is timed and added to that thread's latency_table,
+// under the path it took. The tables are merged and reported at exit,
+// and after the signal given by CHEAP_LATENCY_SIGNAL, if any: its
+// handler only sets latencyReportRequested, and the next sampled call
+// writes the report.
+
+static int latencySampleRate = 0;
+static std::atomic<bool> latencyReportRequested {false};
+static void reportLatency();
+static std::atomic<cheap::latency_table *> latencyTables {nullptr};
+static __thread cheap::latency_table * latencyTable __attribute__((tls_model ("initial-exec")));
+static __thread int latencyCountdown __attribute__((tls_model ("initial-exec")));
+
+static inline __attribute__((always_inline)) bool sampleLatency() {
+  if (likely(latencySampleRate == 0) || (--latencyCountdown > 0)) {
+    return false;
+  }
+  latencyCountdown = latencySampleRate;
+  return true;
+}
+
+static void recordLatency(int op, int path, uint64_t elapsed) {
+  auto * t = latencyTable;
+  if (unlikely(!t)) {
+    auto * buf = HL::MmapWrapper::map(sizeof(cheap::latency_table));
+    if (!buf) {
+      return;
+    }
+    t = new (buf) cheap::latency_table;
+    t->next = latencyTables.load(std::memory_order_relaxed);
+    while (!latencyTables.compare_exchange_weak(t->next, t, std::memory_order_release)) {}
+    latencyTable = t;
+  }
+  t->cycles[op][path].addLocal(elapsed);
+  if (unlikely(latencyReportRequested.load(std::memory_order_relaxed)) && latencyReportRequested.exchange(false)) {
+    reportLatency();
+  }
+}
+
+static void * __attribute__((noinline)) timedMalloc(size_t sz) {
+  // Tell a refill or a freelist miss by what the scope's heap did.
+  auto ci = current();
+  bool scoped = ci && ci->in_cheap;
+  auto refills = scoped ? ci->refills() : 0;
+  auto misses = (scoped && ci->freelist) ? ci->freelist->misses() : 0;
+  auto start = cheap::cycles();
+  auto ptr = mallocPath(sz);
+  auto elapsed = cheap::cycles() - start;
+  int path = cheap::latency_table::Fallback;
+  if (scoped && (ownerMap.tag(ptr) == cheap::owner_map::Scope)) {
+    if (ci->freelist) {
+      path = (ci->freelist->misses() != misses) ? cheap::latency_table::FreelistMiss : cheap::latency_table::FreelistHit;
+    } else {
+      path = (ci->refills() != refills) ? cheap::latency_table::RegionRefill : cheap::latency_table::RegionBump;
+    }
+  }
+  recordLatency(cheap::latency_table::Malloc, path, elapsed);
+  return ptr;
+}
+
+static void __attribute__((noinline)) timedFree(void * ptr) {
+  auto ci = current();
+  int path = cheap::latency_table::Fallback;
+  if (ci && ci->in_cheap && (ownerMap.tag(ptr) == cheap::owner_map::Scope)) {
+    path = ci->freelist ? cheap::latency_table::FreelistHit : cheap::latency_table::RegionBump;
+  }
+  auto start = cheap::cycles();
+  freePath(ptr);
+  recordLatency(cheap::latency_table::Free, path, cheap::cycles() - start);
+}
+
+static bool sampleStack();
+static void * verifiedMalloc(size_t sz);
+
+static void * __attribute__((noinline)) instrumentedMalloc(size_t sz) {
+  if (sampleLatency()) {
+    return timedMalloc(sz);
+  }
+  if (sampleStack()) {
+    return verifiedMalloc(sz);
+  }
+  return mallocPath(sz);
+}
+
+static void __attribute__((noinline)) instrumentedFree(void * ptr) {
+  if (sampleLatency()) {
+    return timedFree(ptr);
+  }
+  freePath(ptr);
+}
+
 extern "C" void FLATTEN xxfree_sized(void *ptr, size_t) {
   xxfree(ptr);
 }
 
 extern "C" void * FLATTEN xxmemalign(size_t alignment, size_t sz) {
   auto ci = current();
-  if (likely(ci && ci->in_cheap)) {
+  if (likely(ci && ci->in_cheap) && ci->captures()) {
     // Round up the region pointer to the required alignment.
     // auto bufptr = reinterpret_cast<uintptr_t>(ci->region.malloc(sz));
     // FIXME THIS IS NOT ENOUGH
@@ -104,6 +472,1199 @@ extern "C" void * FLATTEN xxmemalign(size_t alignment, size_t sz) {
   return getTheCustomHeap().memalign(alignment, sz);
 }
 
+#if !defined(__APPLE__)
+
+#include <pthread.h>
+
+extern "C" {
+  typedef int pthreadcreateFn(pthread_t *, const pthread_attr_t *, void *(*)(void *), void *);
+}
+
+// Threads created inside a scope start with the scope chosen by
+// cheap_base::spawn() (see cheap::INHERIT_THREADS).
+
+class cheap_thread_start {
+public:
+  void * (*fn)(void *);
+  void * arg;
+  cheap::cheap_base * scope;
+};
+
+static std::atomic<pthreadcreateFn *> realCreate {nullptr};
+
+/// Resolve the real pthread_create (at load, or if a thread is created
+/// before our constructors run).
+static pthreadcreateFn * resolveRealCreate() {
+  pthreadcreateFn * fn;
+  *(void **)(&fn) = dlsym(RTLD_NEXT, "pthread_create");
+  realCreate.store(fn, std::memory_order_release);
+  return fn;
+}
+
+static void initializeThreads() {
+  resolveRealCreate();
+}
+
+static void leaveScope(void *) {
+  current() = nullptr;
+}
+
+static void * cheapThreadStart(void * p) {
+  auto start = *static_cast<cheap_thread_start *>(p);
+  getTheCustomHeap().free(p);
+  current() = start.scope;
+  void * result;
+  // Leave the scope however the thread ends (including pthread_exit),
+  // before any thread-specific data destructors run.
+  pthread_cleanup_push(leaveScope, nullptr);
+  result = (*start.fn)(start.arg);
+  pthread_cleanup_pop(1);
+  return result;
+}
+
+extern "C" __attribute__((visibility("default"))) int pthread_create(pthread_t * thread,
+								    const pthread_attr_t * attr,
+								    void *(*fn)(void *),
+								    void * arg)
+{
+  auto * create = realCreate.load(std::memory_order_acquire);
+  if (unlikely(create == nullptr)) {
+    create = resolveRealCreate();
+  }
+  auto ci = current();
+  cheap::cheap_base * scope = nullptr;
+  if (unlikely(ci && ci->in_cheap)) {
+    scope = ci->spawn();
+  }
+  void * buf = nullptr;
+  if (unlikely(scope != nullptr)) {
+    buf = getTheCustomHeap().malloc(sizeof(cheap_thread_start));
+  }
+  if (likely(!buf)) {
+    return (*create)(thread, attr, fn, arg);
+  }
+  auto start = new (buf) cheap_thread_start { fn, arg, scope };
+  auto result = (*create)(thread, attr, cheapThreadStart, start);
+  if (result != 0) {
+    getTheCustomHeap().free(start);
+  }
+  return result;
+}
+
+#endif
+
+// The engine behind the C API: the same heaps as cheap::cheap<Flags>,
+// with the flags checked at run time.
+
+struct cheap_scope : public cheap::cheap_base {
+  cheap_scope(int flags, size_t sizeHint)
+    : _flags (flags),
+      // The hint is the object size for SAME_SIZE scopes, and otherwise
+      // (for regions) the first chunk's size.
+      _region (((flags & CHEAP_DISABLE_FREE) && !(flags & CHEAP_SAME_SIZE) && sizeHint) ? sizeHint : CheapRegionHeap::defaultChunkSize()),
+      _oneSize (sizeHint)
+  {
+    if (!(flags & CHEAP_DISABLE_FREE)) {
+      freelist = &_freelist;
+      if (flags & CHEAP_SAME_SIZE) {
+	cache_size = sizeHint;
+      }
+    }
+    in_cheap = true;
+  }
+
+  ~cheap_scope() {
+    in_cheap = false;
+    auto * c = _children;
+    while (c) {
+      auto * next = c->_nextChild;
+      c->~cheap_scope();
+      getTheCustomHeap().free(c);
+      c = next;
+    }
+  }
+
+  void * malloc(size_t req_sz) override {
+    size_t sz = req_sz;
+    if (!(_flags & CHEAP_ALIGNED)) {
+      if (!(_flags & CHEAP_NONZERO) && (sz < MIN_ALIGNMENT)) {
+	sz = MIN_ALIGNMENT;
+      }
+      sz = (sz + MIN_ALIGNMENT - 1) & ~(MIN_ALIGNMENT - 1);
+    }
+    if (!(_flags & CHEAP_DISABLE_FREE)) {
+      return _freelist.malloc(sz);
+    }
+    if (!(_flags & (CHEAP_SIZE_TAKEN | CHEAP_SAME_SIZE))) {
+      return _region.malloc(sz);
+    }
+    auto ptr = _region.malloc(sz + sizeof(cheap::cheap_header));
+    if (!ptr) {
+      return nullptr;
+    }
+    new (ptr) cheap::cheap_header(sz);
+    return (cheap::cheap_header *) ptr + 1;
+  }
+
+  void free(void * ptr) override {
+    if (!(_flags & CHEAP_DISABLE_FREE)) {
+      _freelist.free(ptr);
+    } else {
+#if USE_SCOPE_STATS
+      instance->ignoredFrees++;
+#endif
+    }
+  }
+
+  size_t getSize(void * ptr) override {
+    if (_flags & CHEAP_SAME_SIZE) {
+      return _oneSize;
+    }
+    if ((_flags & CHEAP_SIZE_TAKEN) && (_flags & CHEAP_DISABLE_FREE)) {
+      return ((cheap::cheap_header *) ptr - 1)->object_size;
+    }
+    // No size was kept: realloc would silently copy nothing.
+    static const char msg[] = "cheap: realloc or malloc_usable_size in a scope without sizes (use CHEAP_SIZE_TAKEN | CHEAP_DISABLE_FREE, or CHEAP_SAME_SIZE)\n";
+    auto n = write(2, msg, sizeof(msg) - 1);
+    (void) n;
+    abort();
+  }
+
+  cheap_base * spawn() override {
+    if (!(_flags & CHEAP_INHERIT_THREADS)) {
+      return nullptr;
+    }
+    auto * buf = getTheCustomHeap().malloc(sizeof(cheap_scope));
+    if (!buf) {
+      return nullptr;
+    }
+    auto * c = new (buf) cheap_scope(_flags, _oneSize);
+    _childLock.lock();
+    c->_nextChild = _children;
+    _children = c;
+    _childLock.unlock();
+    return c;
+  }
+
+  uint64_t refills() const override {
+    return isRegion() ? _region.refills() : 0;
+  }
+
+  uint64_t refilledBytes() const override {
+    return isRegion() ? _region.refilledBytes() : 0;
+  }
+
+  bool untouched(void * ptr) const override {
+    return isRegion() && !sites && _region.untouched(ptr);
+  }
+
+  cheap::cheap_base * enclosing() const override {
+    return previous;
+  }
+
+  bool isRegion() const {
+    return _flags & CHEAP_DISABLE_FREE;
+  }
+
+  CheapRegionHeap& region() {
+    return _region;
+  }
+
+  cheap_base * previous {nullptr};
+
+private:
+  int _flags;
+  CheapRegionHeap _region;
+  CheapFreelistHeap _freelist;
+  size_t _oneSize;
+  cheap_scope * _children {nullptr};
+  cheap_scope * _nextChild {nullptr};
+  spin_lock _childLock;
+};
+
+static_assert(sizeof(CheapRegionHeap::Mark) <= sizeof(cheap_mark_t),
+	      "cheap_mark_t must be able to hold a region mark.");
+
+static void closeInstance(cheap::scope_instance& instance, uint64_t refills, uint64_t mapped);
+static void releaseInstance(cheap::cheap_base * scope);
+
+/// Open a C API scope; pc identifies it in scope measurements.
+static cheap_handle_t beginScope(int flags, size_t size_hint, uintptr_t pc) {
+  if ((flags & CHEAP_FIXED_BUFFER) || !(flags & (CHEAP_DISABLE_FREE | CHEAP_SAME_SIZE))) {
+    return nullptr;
+  }
+  auto * buf = getTheCustomHeap().malloc(sizeof(cheap_scope));
+  if (!buf) {
+    return nullptr;
+  }
+  auto * scope = new (buf) cheap_scope(flags, size_hint);
+  scope->previous = current();
+  current() = scope;
+  CHEAP_PROBE3(scope_begin, scope, 0, pc);
+  scopeOpened(scope, nullptr, 0, pc);
+  return scope;
+}
+
+extern "C" __attribute__((visibility("default"))) cheap_handle_t cheap_begin(int flags, size_t size_hint) {
+  return beginScope(flags, size_hint, (uintptr_t) __builtin_return_address(0));
+}
+
+extern "C" __attribute__((visibility("default"))) void cheap_end(cheap_handle_t scope) {
+  if (!scope) {
+    return;
+  }
+  if (current() == scope) {
+    current() = scope->previous;
+  }
+  CHEAP_PROBE1(scope_end, scope);
+  // Measure through the release of the scope's memory.
+  cheap::scope_instance instance;
+  uint64_t refills = 0, mapped = 0;
+  if (scope->instance) {
+    instance = *scope->instance;
+    refills = scope->refills() - instance.refillsAtOpen;
+    mapped = scope->refilledBytes() - instance.refilledBytesAtOpen;
+    releaseInstance(scope);
+  }
+  scope->~cheap_scope();
+  getTheCustomHeap().free(scope);
+  closeInstance(instance, refills, mapped);
+}
+
+extern "C" __attribute__((visibility("default"))) cheap_stats_t cheap_stats(cheap_handle_t scope) {
+  return cheap::stats(scope ? scope : current());
+}
+
+extern "C" __attribute__((visibility("default"))) cheap_mark_t cheap_mark(cheap_handle_t scope) {
+  cheap_mark_t m {};
+  if (scope && scope->isRegion()) {
+    auto rm = scope->region().mark();
+    memcpy(&m, &rm, sizeof(rm));
+  }
+  return m;
+}
+
+extern "C" __attribute__((visibility("default"))) void cheap_rewind(cheap_handle_t scope, cheap_mark_t m) {
+  if (scope && scope->isRegion()) {
+    CheapRegionHeap::Mark rm;
+    memcpy(&rm, &m, sizeof(rm));
+    scope->region().rewind(rm);
+  }
+}
+
+#if USE_CONFIGURED_SCOPES
+
+// Scopes applied by configuration (see scopeconfig.h), opened and
+// closed around each listed function by the -finstrument-functions
+// hooks below. A function that recurses keeps its outermost scope.
+
+static cheap::scope_config scopeConfig;
+static char scopeConfigText[16384];
+
+class configured_scope {
+public:
+  void * fn;
+  cheap_handle_t handle;
+  int depth;
+};
+
+enum { MaxConfiguredScopes = 32 };
+static __thread configured_scope configuredScopes[MaxConfiguredScopes] __attribute__((tls_model ("initial-exec")));
+static __thread int numConfiguredScopes __attribute__((tls_model ("initial-exec")));
+
+static void loadScopeConfig() {
+  auto * text = getenv("CHEAP_SCOPES");
+  if (text && *text) {
+    strncpy(scopeConfigText, text, sizeof(scopeConfigText) - 1);
+  } else if (auto * path = getenv("CHEAP_CONFIG")) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    auto n = read(fd, scopeConfigText, sizeof(scopeConfigText) - 1);
+    close(fd);
+    if (n <= 0) {
+      return;
+    }
+    scopeConfigText[n] = '\0';
+  } else {
+    return;
+  }
+  scopeConfig.parse(scopeConfigText);
+}
+
+extern "C" __attribute__((visibility("default"), no_instrument_function))
+void __cyg_profile_func_enter(void * fn, void *) {
+  if (likely(scopeConfig.empty())) {
+    return;
+  }
+  auto * e = scopeConfig.find(fn);
+  if (likely(e == nullptr)) {
+    return;
+  }
+  auto n = numConfiguredScopes;
+  if ((n > 0) && (configuredScopes[n - 1].fn == fn)) {
+    configuredScopes[n - 1].depth++;
+    return;
+  }
+  if (n == MaxConfiguredScopes) {
+    return;
+  }
+  auto handle = beginScope(e->flags, e->size, (uintptr_t) fn);
+  if (handle) {
+    configuredScopes[n] = configured_scope { fn, handle, 1 };
+    numConfiguredScopes = n + 1;
+  }
+}
+
+extern "C" __attribute__((visibility("default"), no_instrument_function))
+void __cyg_profile_func_exit(void * fn, void *) {
+  auto n = numConfiguredScopes;
+  if (likely(n == 0)) {
+    return;
+  }
+  // Usually the top entry; deeper ones mean inner functions were left
+  // without exit hooks (e.g., by an exception), so end their scopes too.
+  for (auto i = n - 1; i >= 0; i--) {
+    if (configuredScopes[i].fn != fn) {
+      continue;
+    }
+    while (numConfiguredScopes > i + 1) {
+      numConfiguredScopes--;
+      cheap_end(configuredScopes[numConfiguredScopes].handle);
+    }
+    if (--configuredScopes[i].depth == 0) {
+      numConfiguredScopes = i;
+      cheap_end(configuredScopes[i].handle);
+    }
+    return;
+  }
+}
+
+#endif
+
+// Scope measurements and A/B evaluation (see scopestats.h). With
+// CHEAP_AB=<fraction> in the environment, every scope instance is
+// timed and the given fraction of them, chosen at random, is bypassed:
+// its allocations go to the heap, as if the scope were not there. At
+// exit, per-scope latency and bytes distributions for both arms are
+// written to the file named by CHEAP_STATS_FILE (default: stderr).
+// With USE_SCOPE_STATS, every instance is measured (in the scoped
+// arm, unless CHEAP_AB is set), and the report is written if either
+// variable is set. With CHEAP_LIVE=1, per-site totals are also
+// published as they accrue, in a shared memory segment that cheap-top
+// reads (see livestats.h).
+
+static cheap::scope_sites scopeSites;
+static bool measureScopes = false;
+static bool reportScopes = false;
+static cheap::live_stats * livePage = nullptr;
+
+// Scope verification (CHEAP_VERIFY=<n>): the call stack of one
+// xxmalloc in n on each thread is recorded in sampledStacks, with
+// whether a scope served it. The report at exit shows, per stack, the
+// fraction its scopes captured.
+
+static int stackSampleRate = 0;
+static cheap::stack_table sampledStacks;
+static __thread int stackCountdown __attribute__((tls_model ("initial-exec")));
+
+static inline __attribute__((always_inline)) bool sampleStack() {
+  if (likely(stackSampleRate == 0) || (--stackCountdown > 0)) {
+    return false;
+  }
+  stackCountdown = stackSampleRate;
+  return true;
+}
+
+/// Up to depth return addresses outside libcheap, innermost first
+/// (never used in static builds; see CHEAP_VERIFY). Like callSite(),
+/// this walks frame pointers; it stops at the first
+/// frame that does not look like one further up the stack, so code
+/// built without them yields shorter stacks.
+static int __attribute__((noinline)) callStack(uintptr_t * frames, int depth) {
+  int n = 0;
+  auto ** fp = (void **) __builtin_frame_address(0);
+  for (int i = 0; (i < 64) && fp && (n < depth); i++) {
+    auto ra = (uintptr_t) fp[1];
+    if (!libcheapCode.contains(ra)) {
+      frames[n++] = ra;
+    }
+    auto ** next = (void **) fp[0];
+    if ((next <= fp) || ((char *) next - (char *) fp > 1048576) || ((uintptr_t) next & (sizeof(void *) - 1))) {
+      break;
+    }
+    fp = next;
+  }
+  return n;
+}
+
+static void * __attribute__((noinline)) verifiedMalloc(size_t sz) {
+  auto ci = current();
+  auto ptr = mallocPath(sz);
+  uintptr_t frames[cheap::stack_table::Depth];
+  auto n = callStack(frames, cheap::stack_table::Depth);
+  auto * e = sampledStacks.find(frames, n);
+  if (!e) {
+    return ptr;
+  }
+  if (ci && ci->in_cheap && (ownerMap.tag(ptr) == cheap::owner_map::Scope)) {
+    e->scoped.fetch_add(1, std::memory_order_relaxed);
+    if (ci->instance && ci->instance->site) {
+      e->scope.store(scopeSites.indexOf(ci->instance->site) + 1, std::memory_order_relaxed);
+    }
+  } else if (ci) {
+    e->heapInScope.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    e->heapOutside.fetch_add(1, std::memory_order_relaxed);
+  }
+  return ptr;
+}
+
+// With CHEAP_RSS=1, each scope instance's page faults (on its thread)
+// and the growth of the process's resident set are measured, along
+// with the bytes its region obtained. Its peak resident set is
+// estimated from those, without touching process-wide state such as
+// VmHWM: the larger of the resident set at its end, and the resident
+// set at its start plus the region memory it obtained.
+static bool measureMemory = false;
+static int statmFd = -1;
+
+static void openStatm() {
+  if (statmFd >= 0) {
+    close(statmFd);
+  }
+  statmFd = open("/proc/self/statm", O_RDONLY);
+}
+
+/// This thread's page faults, and the resident set size in bytes.
+static void memoryUsage(uint64_t& minorFaults, uint64_t& majorFaults, uint64_t& rss) {
+  struct rusage ru;
+#if defined(RUSAGE_THREAD)
+  getrusage(RUSAGE_THREAD, &ru);
+#else
+  getrusage(RUSAGE_SELF, &ru);
+#endif
+  minorFaults = ru.ru_minflt;
+  majorFaults = ru.ru_majflt;
+  rss = 0;
+  // statm: total program size, then resident pages.
+  char buf[128];
+  auto n = (statmFd >= 0) ? pread(statmFd, buf, sizeof(buf) - 1, 0) : -1;
+  if (n <= 0) {
+    return;
+  }
+  buf[n] = '\0';
+  auto * p = strchr(buf, ' ');
+  if (p) {
+    rss = strtoull(p + 1, nullptr, 10) * sysconf(_SC_PAGESIZE);
+  }
+}
+
+static void initializeMemoryUsage() {
+  measureMemory = true;
+  openStatm();
+  // /proc/self was resolved when it was opened: reopen it in children.
+  pthread_atfork(nullptr, nullptr, openStatm);
+}
+
+// With CHEAP_PERF=1, each thread's perf counters are read at scope
+// entry and exit, and the per-site differences are reported.
+static cheap::perf_counters::kind perfKind = cheap::perf_counters::None;
+static __thread cheap::perf_counters threadCounters __attribute__((tls_model ("initial-exec")));
+static pthread_key_t perfKey;
+
+static void closeThreadCounters(void *) {
+  threadCounters.close();
+}
+
+/// This thread's counters, opened on first use.
+static inline cheap::perf_counters& perfCounters() {
+  if (unlikely(!threadCounters.isOpen())) {
+    if (threadCounters.open(perfKind)) {
+      pthread_setspecific(perfKey, (void *) 1);
+    }
+  }
+  return threadCounters;
+}
+
+/// Pick hardware counters if this process can open them, else software.
+static void initializePerfCounters() {
+  if (pthread_key_create(&perfKey, closeThreadCounters) != 0) {
+    return;
+  }
+  if (threadCounters.open(cheap::perf_counters::Hardware)) {
+    perfKind = cheap::perf_counters::Hardware;
+  } else if (threadCounters.open(cheap::perf_counters::Software)) {
+    perfKind = cheap::perf_counters::Software;
+  }
+}
+// With CHEAP_TRACE=1, scope instances and region chunk events go into
+// per-thread trace_rings, written at exit as Chrome trace-event JSON
+// (for chrome://tracing or Perfetto) to CHEAP_TRACE_FILE, by default
+// cheap-trace.<pid>.json.
+static bool tracing = false;
+static std::atomic<cheap::trace_ring *> traceRings {nullptr};
+static __thread cheap::trace_ring * traceRing __attribute__((tls_model ("initial-exec")));
+
+static void traceEvent(const cheap::trace_ring::event& e) {
+  auto * r = traceRing;
+  if (unlikely(!r)) {
+    auto * buf = HL::MmapWrapper::map(sizeof(cheap::trace_ring));
+    if (!buf) {
+      return;
+    }
+    r = new (buf) cheap::trace_ring;
+    r->tid = (int) syscall(SYS_gettid);
+    r->next = traceRings.load(std::memory_order_relaxed);
+    while (!traceRings.compare_exchange_weak(r->next, r, std::memory_order_release)) {}
+    traceRing = r;
+  }
+  r->push(e);
+}
+
+__attribute__((visibility("default"))) uint64_t chunkEventStart() {
+  return unlikely(tracing) ? cheap::nanoseconds() : 0;
+}
+
+__attribute__((visibility("default"))) void chunkEvent(bool acquired, uint64_t start, size_t sz) {
+  cheap::trace_ring::event e {};
+  e.start = start;
+  e.duration = cheap::nanoseconds() - start;
+  e.bytes = sz;
+  e.kind = acquired ? cheap::trace_ring::Refill : cheap::trace_ring::Release;
+  traceEvent(e);
+}
+
+static uint64_t bypassThreshold = 0; // out of 2^32
+
+/// Stands in (as current()) for a bypassed scope instance: requests
+/// are served by the enclosing scope, or the heap if there is none,
+/// but counted against the bypassed instance.
+struct bypass_scope : public cheap::cheap_base {
+  bypass_scope(cheap::cheap_base * target, cheap::scope_instance * in)
+    : _target (target)
+  {
+    if (target) {
+      in_cheap = target->in_cheap;
+      bump = target->bump;
+      freelist = target->freelist;
+      cache_size = target->cache_size;
+#if USE_SIZE_CACHES
+      if (cache_size) {
+	cache_id = cacheOwner(target);
+      }
+#endif
+      filter = target->filter;
+      sites = target->sites;
+    }
+    instance = in;
+  }
+
+  // Only reached when in_cheap, that is, when there is a target.
+  void * malloc(size_t sz) override {
+    return _target->malloc(sz);
+  }
+
+  void free(void * ptr) override {
+    _target->free(ptr);
+  }
+
+  size_t getSize(void * ptr) override {
+    return _target->getSize(ptr);
+  }
+
+  bool untouched(void * ptr) const override {
+    return _target->untouched(ptr);
+  }
+
+  cheap_base * spawn() override {
+    return _target ? _target->spawn() : nullptr;
+  }
+
+  cheap_base * enclosing() const override {
+    return _target;
+  }
+
+private:
+  cheap::cheap_base * _target;
+};
+
+static __thread uint64_t abRandom __attribute__((tls_model ("initial-exec")));
+
+/// A per-thread xorshift generator; good enough to pick arms.
+static inline uint32_t nextRandom() {
+  auto x = abRandom;
+  if (unlikely(x == 0)) {
+    x = cheap::cycles() ^ (uintptr_t) &abRandom;
+    x |= 1;
+  }
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  abRandom = x;
+  return (uint32_t) (x >> 32);
+}
+
+/// Create and map the live stats segment for this process.
+static void publishLiveStats() {
+  char name[64];
+  cheap::live_stats::segmentName(name, sizeof(name), getpid());
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    return;
+  }
+  if (ftruncate(fd, sizeof(cheap::live_stats)) != 0) {
+    close(fd);
+    shm_unlink(name);
+    return;
+  }
+  auto * page = mmap(nullptr, sizeof(cheap::live_stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (page == MAP_FAILED) {
+    shm_unlink(name);
+    return;
+  }
+  livePage = (cheap::live_stats *) page;
+  livePage->version = cheap::live_stats::Version;
+  livePage->pid = getpid();
+  __atomic_store_n(&livePage->magic, (uint32_t) cheap::live_stats::Magic, __ATOMIC_RELEASE);
+}
+
+static void requestLatencyReport(int) {
+  latencyReportRequested.store(true, std::memory_order_relaxed);
+}
+
+static void initializeScopeStats() {
+  measureScopes = USE_SCOPE_STATS;
+  auto * path = getenv("CHEAP_STATS_FILE");
+  reportScopes = measureScopes && path && *path;
+  auto * perf = getenv("CHEAP_PERF");
+  if (perf && (atoi(perf) != 0)) {
+    initializePerfCounters();
+    measureScopes = measureScopes || (perfKind != cheap::perf_counters::None);
+    reportScopes = measureScopes;
+  }
+  auto * trace = getenv("CHEAP_TRACE");
+  if (trace && (atoi(trace) != 0)) {
+    tracing = true;
+    measureScopes = true;
+  }
+  auto * rss = getenv("CHEAP_RSS");
+  if (rss && (atoi(rss) != 0)) {
+    initializeMemoryUsage();
+    measureScopes = true;
+    reportScopes = true;
+  }
+  auto * verify = getenv("CHEAP_VERIFY");
+  if (verify && (atoi(verify) > 0)) {
+#if CHEAP_STATIC
+    // libcheap is part of the executable, so callStack() would filter
+    // out every frame and report one empty stack.
+    static const char msg[] = "cheap: CHEAP_VERIFY needs the shared library; ignored in static builds\n";
+    auto n = write(2, msg, sizeof(msg) - 1);
+    (void) n;
+#else
+    stackSampleRate = atoi(verify);
+    instrumenting = true;
+    measureScopes = true;
+#endif
+  }
+  auto * rate = getenv("CHEAP_LATENCY");
+  if (rate && (atoi(rate) > 0)) {
+    latencySampleRate = atoi(rate);
+    instrumenting = true;
+    auto * sig = getenv("CHEAP_LATENCY_SIGNAL");
+    if (sig && (atoi(sig) > 0)) {
+      struct sigaction sa {};
+      sa.sa_handler = requestLatencyReport;
+      sa.sa_flags = SA_RESTART;
+      sigaction(atoi(sig), &sa, nullptr);
+    }
+  }
+  auto * live = getenv("CHEAP_LIVE");
+  if (live && (atoi(live) != 0)) {
+    publishLiveStats();
+    measureScopes = measureScopes || (livePage != nullptr);
+  }
+  auto * fraction = getenv("CHEAP_AB");
+  if (!fraction || !*fraction) {
+    return;
+  }
+  auto f = strtod(fraction, nullptr);
+  f = (f < 0) ? 0 : ((f > 1) ? 1 : f);
+  bypassThreshold = (uint64_t) (f * 4294967296.0);
+  measureScopes = true;
+  reportScopes = true;
+}
+
+/// A readable name for a code address: the function and offset, or
+/// else the object and offset (for addr2line).
+static void codeName(uintptr_t pc, char * name, size_t size) {
+  Dl_info info {};
+  dladdr((void *) pc, &info);
+  if (info.dli_sname) {
+    snprintf(name, size, "%s+0x%lx", info.dli_sname, (unsigned long) (pc - (uintptr_t) info.dli_saddr));
+  } else if (info.dli_fname) {
+    snprintf(name, size, "%s+0x%lx", info.dli_fname, (unsigned long) (pc - (uintptr_t) info.dli_fbase));
+  } else {
+    snprintf(name, size, "0x%lx", (unsigned long) pc);
+  }
+}
+
+/// A readable name for site: file:line for C++ scopes; otherwise the
+/// code that opened it.
+static void siteName(const cheap::scope_site& site, char * name, size_t size) {
+  if (site.file) {
+    snprintf(name, size, "%s:%d", site.file, site.line);
+    return;
+  }
+  codeName(site.pc, name, size);
+}
+
+static void __attribute__((noinline)) nameLiveSite(const cheap::scope_site& site) {
+  auto i = scopeSites.indexOf(&site);
+  siteName(site, livePage->sites[i].name, sizeof(livePage->sites[i].name));
+  // Readers show sites below count, so publish it after the name.
+  auto count = livePage->count.load(std::memory_order_relaxed);
+  while (((uint32_t) i >= count) && !livePage->count.compare_exchange_weak(count, i + 1, std::memory_order_release)) {}
+}
+
+__attribute__((visibility("default"))) void scopeOpened(cheap::cheap_base * scope, const char * file, int line, uintptr_t pc) {
+  if (likely(!measureScopes)) {
+    return;
+  }
+#if USE_SCOPE_STATS
+  scope->instance->refillsAtOpen = scope->refills();
+#endif
+  auto * site = scopeSites.find(file, line, pc);
+  if (!site) {
+    return;
+  }
+  if (!scope->instance) {
+    auto * buf = getTheCustomHeap().malloc(sizeof(cheap::scope_instance));
+    if (!buf) {
+      return;
+    }
+    scope->instance = new (buf) cheap::scope_instance;
+  }
+  auto& in = *scope->instance;
+  in.refillsAtOpen = scope->refills();
+  in.site = site;
+  if (unlikely(livePage != nullptr) && !in.site->published.exchange(true)) {
+    nameLiveSite(*in.site);
+  }
+  in.allocations = 0;
+  in.bytes = 0;
+  in.spills = 0;
+  in.bypassed = false;
+  if (nextRandom() < bypassThreshold) {
+    // Step aside, as if the scope were not there: the enclosing scope
+    // (or the heap) serves this instance, through a stand-in that
+    // counts its requests. closeInstance removes it.
+    auto * buf = getTheCustomHeap().malloc(sizeof(bypass_scope));
+    if (buf) {
+      in.bypassed = true;
+      in.passThrough = new (buf) bypass_scope(scope->enclosing(), &in);
+      current() = in.passThrough;
+    }
+  }
+  if (unlikely(perfKind != cheap::perf_counters::None)) {
+    perfCounters().read(in.counters);
+  }
+  if (unlikely(tracing)) {
+    in.traceStart = cheap::nanoseconds();
+  }
+  if (unlikely(measureMemory)) {
+    in.refilledBytesAtOpen = scope->refilledBytes();
+    memoryUsage(in.minorFaults, in.majorFaults, in.rss);
+  }
+  in.start = cheap::cycles();
+}
+
+static void closeInstance(cheap::scope_instance& in, uint64_t refills, uint64_t mapped) {
+  if (likely(!in.site)) {
+    return;
+  }
+  auto elapsed = cheap::cycles() - in.start;
+  if (in.passThrough) {
+    if (current() == in.passThrough) {
+      current() = in.passThrough->enclosing();
+    }
+    static_cast<bypass_scope *>(in.passThrough)->~bypass_scope();
+    getTheCustomHeap().free(in.passThrough);
+    in.passThrough = nullptr;
+  }
+  auto& arm = in.site->arms[in.bypassed ? cheap::scope_site::Bypassed : cheap::scope_site::Scoped];
+  if (unlikely(measureMemory)) {
+    uint64_t minorFaults, majorFaults, rss;
+    memoryUsage(minorFaults, majorFaults, rss);
+    arm.minorFaults.fetch_add(minorFaults - in.minorFaults, std::memory_order_relaxed);
+    arm.majorFaults.fetch_add(majorFaults - in.majorFaults, std::memory_order_relaxed);
+    arm.mappedBytes.fetch_add(mapped, std::memory_order_relaxed);
+    arm.rssGrowth.fetch_add((int64_t) (rss - in.rss), std::memory_order_relaxed);
+    // Region memory is usually released before the end is sampled.
+    auto high = (in.rss + mapped > rss) ? in.rss + mapped : rss;
+    auto peak = arm.rssPeak.load(std::memory_order_relaxed);
+    while ((high > peak) && !arm.rssPeak.compare_exchange_weak(peak, high, std::memory_order_relaxed)) {}
+  }
+  if (unlikely(perfKind != cheap::perf_counters::None)) {
+    uint64_t now[cheap::NumPerfCounters];
+    perfCounters().read(now);
+    for (int i = 0; i < cheap::NumPerfCounters; i++) {
+      arm.counters[i].fetch_add(now[i] - in.counters[i], std::memory_order_relaxed);
+    }
+  }
+  arm.instances.fetch_add(1, std::memory_order_relaxed);
+  arm.allocations.fetch_add(in.allocations, std::memory_order_relaxed);
+  arm.refills.fetch_add(refills, std::memory_order_relaxed);
+  arm.ignoredFrees.fetch_add(in.ignoredFrees, std::memory_order_relaxed);
+  arm.spills.fetch_add(in.spills, std::memory_order_relaxed);
+  arm.cycles.add(elapsed);
+  arm.bytes.add(in.bytes);
+  if (unlikely(livePage != nullptr)) {
+    livePage->sites[scopeSites.indexOf(in.site)].add(in.bytes, refills, in.spills, in.ignoredFrees);
+  }
+  if (unlikely(tracing)) {
+    cheap::trace_ring::event e {};
+    e.start = in.traceStart;
+    e.duration = cheap::nanoseconds() - in.traceStart;
+    e.bytes = in.bytes;
+    e.allocations = (uint32_t) in.allocations;
+    e.spills = (uint32_t) in.spills;
+    e.kind = cheap::trace_ring::Scope;
+    e.site = (uint16_t) scopeSites.indexOf(in.site);
+    traceEvent(e);
+  }
+  in.site = nullptr;
+}
+
+__attribute__((visibility("default"))) void scopeClosed(cheap::cheap_base * scope) {
+  auto * in = scope->instance;
+  if (!in) {
+    return;
+  }
+  closeInstance(*in, scope->refills() - in->refillsAtOpen,
+		scope->refilledBytes() - in->refilledBytesAtOpen);
+  releaseInstance(scope);
+}
+
+/// Free a measured instance's scope_instance (with USE_SCOPE_STATS,
+/// every scope keeps its own).
+static void releaseInstance(cheap::cheap_base * scope) {
+#if !USE_SCOPE_STATS
+  getTheCustomHeap().free(scope->instance);
+  scope->instance = nullptr;
+#else
+  (void) scope;
+#endif
+}
+
+static void writeAll(int fd, const char * buf, int len) {
+  while (len > 0) {
+    auto n = write(fd, buf, len);
+    if (n <= 0) {
+      return;
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+__attribute__((destructor)) static void removeLiveStats() {
+  // Forked children share the parent's page; leave it to the parent.
+  if (livePage && (livePage->pid == (uint32_t) getpid())) {
+    char name[64];
+    cheap::live_stats::segmentName(name, sizeof(name), getpid());
+    shm_unlink(name);
+  }
+}
+
+/// Open the report file (CHEAP_STATS_FILE, or stderr). The first
+/// report in this process truncates it; later ones append.
+static int openReport() {
+  static bool opened = false;
+  auto * path = getenv("CHEAP_STATS_FILE");
+  if (!path || !*path) {
+    return 2;
+  }
+  int fd = open(path, O_WRONLY | O_CREAT | (opened ? O_APPEND : O_TRUNC), 0644);
+  opened = true;
+  return fd;
+}
+
+static void closeReport(int fd) {
+  if (fd > 2) {
+    close(fd);
+  }
+}
+
+__attribute__((destructor)) static void reportScopeStats() {
+  if (!reportScopes || (scopeSites.count() == 0)) {
+    return;
+  }
+  int fd = openReport();
+  if (fd < 0) {
+    return;
+  }
+  char buf[1024];
+  auto * fraction = getenv("CHEAP_AB");
+  auto n = snprintf(buf, sizeof(buf), "# cheap scope stats (CHEAP_AB=%s; cycles from %s)\n"
+		    "# scope\tarm\tinstances\tallocations\trefills\tignored_frees\tspills\tcycles_mean\tcycles_p50\tcycles_p99\tbytes_mean\tbytes_p50\tbytes_p99",
+		    (fraction && *fraction) ? fraction : "0",
+#if defined(__x86_64__) || defined(__i386__)
+		    "rdtsc"
+#else
+		    "CLOCK_MONOTONIC (ns)"
+#endif
+		    );
+  // Perf counters (CHEAP_PERF) are means per instance.
+  for (int c = 0; (perfKind != cheap::perf_counters::None) && (c < cheap::NumPerfCounters); c++) {
+    n += snprintf(buf + n, sizeof(buf) - n, "\tperf_%s", cheap::perf_counters::name(perfKind, c));
+  }
+  // Memory (CHEAP_RSS): means per instance, but for the peak.
+  if (measureMemory) {
+    n += snprintf(buf + n, sizeof(buf) - n, "\tminor_faults\tmajor_faults\tmapped_bytes\trss_growth\trss_peak");
+  }
+  n += snprintf(buf + n, sizeof(buf) - n, "\n");
+  writeAll(fd, buf, n);
+  static const char * armNames[] = { "scoped", "bypassed" };
+  for (int i = 0; i < scopeSites.count(); i++) {
+    auto& site = scopeSites[i];
+    char name[256];
+    siteName(site, name, sizeof(name));
+    for (int a = 0; a < cheap::scope_site::NumArms; a++) {
+      auto& arm = site.arms[a];
+      if ((a == cheap::scope_site::Bypassed) && (bypassThreshold == 0)) {
+	continue;
+      }
+      n = snprintf(buf, sizeof(buf), "%s\t%s\t%llu\t%llu\t%llu\t%llu\t%llu\t%.0f\t%llu\t%llu\t%.0f\t%llu\t%llu",
+		   name, armNames[a],
+		   (unsigned long long) arm.instances.load(),
+		   (unsigned long long) arm.allocations.load(),
+		   (unsigned long long) arm.refills.load(),
+		   (unsigned long long) arm.ignoredFrees.load(),
+		   (unsigned long long) arm.spills.load(),
+		   arm.cycles.mean(),
+		   (unsigned long long) arm.cycles.percentile(50),
+		   (unsigned long long) arm.cycles.percentile(99),
+		   arm.bytes.mean(),
+		   (unsigned long long) arm.bytes.percentile(50),
+		   (unsigned long long) arm.bytes.percentile(99));
+      auto instances = arm.instances.load();
+      for (int c = 0; (perfKind != cheap::perf_counters::None) && (c < cheap::NumPerfCounters); c++) {
+	n += snprintf(buf + n, sizeof(buf) - n, "\t%.1f", instances ? (double) arm.counters[c].load() / instances : 0.0);
+      }
+      if (measureMemory) {
+	n += snprintf(buf + n, sizeof(buf) - n, "\t%.1f\t%.1f\t%.0f\t%.0f\t%llu",
+		      instances ? (double) arm.minorFaults.load() / instances : 0.0,
+		      instances ? (double) arm.majorFaults.load() / instances : 0.0,
+		      instances ? (double) arm.mappedBytes.load() / instances : 0.0,
+		      instances ? (double) arm.rssGrowth.load() / instances : 0.0,
+		      (unsigned long long) arm.rssPeak.load());
+      }
+      n += snprintf(buf + n, sizeof(buf) - n, "\n");
+      writeAll(fd, buf, n);
+    }
+    auto scoped = site.arms[cheap::scope_site::Scoped].cycles.mean();
+    auto bypassed = site.arms[cheap::scope_site::Bypassed].cycles.mean();
+    if ((scoped > 0) && (bypassed > 0)) {
+      n = snprintf(buf, sizeof(buf), "%s\tspeedup\t%.3f\n", name, bypassed / scoped);
+      writeAll(fd, buf, n);
+    }
+  }
+  closeReport(fd);
+}
+
+/// Merge every thread's latency_table and write the result (at exit,
+/// or at the first sampled call after CHEAP_LATENCY_SIGNAL).
+static void reportLatency() {
+  static spin_lock reportLock;
+  static cheap::latency_table total;
+  reportLock.lock();
+  new (&total) cheap::latency_table;
+  for (auto * t = latencyTables.load(std::memory_order_acquire); t; t = t->next) {
+    total.merge(*t);
+  }
+  int fd = openReport();
+  if (fd < 0) {
+    reportLock.unlock();
+    return;
+  }
+  char buf[256];
+  auto n = snprintf(buf, sizeof(buf), "# cheap latency (CHEAP_LATENCY=%d; cycles from %s)\n"
+		    "# op\tpath\tsamples\tmean\tp50\tp90\tp99\tp99.9\n",
+		    latencySampleRate,
+#if defined(__x86_64__) || defined(__i386__)
+		    "rdtsc"
+#else
+		    "CLOCK_MONOTONIC (ns)"
+#endif
+		    );
+  writeAll(fd, buf, n);
+  static const char * opNames[] = { "malloc", "free" };
+  static const char * pathNames[][cheap::latency_table::NumPaths] = {
+    { "region-bump", "region-refill", "freelist-hit", "freelist-miss", "fallback" },
+    { "region-ignored", "-", "freelist", "-", "fallback" },
+  };
+  for (int op = 0; op < cheap::latency_table::NumOps; op++) {
+    for (int path = 0; path < cheap::latency_table::NumPaths; path++) {
+      auto& h = total.cycles[op][path];
+      if (h.count() == 0) {
+	continue;
+      }
+      n = snprintf(buf, sizeof(buf), "%s\t%s\t%llu\t%.0f\t%llu\t%llu\t%llu\t%llu\n",
+		   opNames[op], pathNames[op][path],
+		   (unsigned long long) h.count(),
+		   h.mean(),
+		   (unsigned long long) h.percentile(50),
+		   (unsigned long long) h.percentile(90),
+		   (unsigned long long) h.percentile(99),
+		   (unsigned long long) h.percentile(99.9));
+      writeAll(fd, buf, n);
+    }
+  }
+  closeReport(fd);
+  reportLock.unlock();
+}
+
+__attribute__((destructor)) static void reportLatencyAtExit() {
+  if ((latencySampleRate > 0) && latencyTables.load()) {
+    reportLatency();
+  }
+}
+
+__attribute__((destructor)) static void reportSampledStacks() {
+  if (stackSampleRate == 0) {
+    return;
+  }
+  // Most sampled first.
+  static int order[cheap::stack_table::MaxStacks];
+  int count = 0;
+  for (int i = 0; i < cheap::stack_table::MaxStacks; i++) {
+    if (sampledStacks[i].key.load(std::memory_order_acquire) != 0) {
+      auto samples = sampledStacks[i].samples();
+      int j = count++;
+      for (; (j > 0) && (sampledStacks[order[j - 1]].samples() < samples); j--) {
+	order[j] = order[j - 1];
+      }
+      order[j] = i;
+    }
+  }
+  if (count == 0) {
+    return;
+  }
+  int fd = openReport();
+  if (fd < 0) {
+    return;
+  }
+  char buf[1024];
+  int n = snprintf(buf, sizeof(buf),
+		   "# cheap verify: allocating call stacks, 1 in %d mallocs sampled (%llu dropped)\n"
+		   "samples\tscoped\theap_in_scope\theap_outside\tcaptured\tscope\tstack\n",
+		   stackSampleRate, (unsigned long long) sampledStacks.dropped());
+  writeAll(fd, buf, n);
+  for (int k = 0; k < count; k++) {
+    auto& e = sampledStacks[order[k]];
+    auto samples = e.samples();
+    auto scoped = e.scoped.load(std::memory_order_relaxed);
+    char scope[256] = "-";
+    auto s = e.scope.load(std::memory_order_relaxed);
+    if (s > 0) {
+      siteName(scopeSites[s - 1], scope, sizeof(scope));
+    }
+    n = snprintf(buf, sizeof(buf), "%llu\t%llu\t%llu\t%llu\t%.1f%%\t%s\t",
+		 (unsigned long long) samples, (unsigned long long) scoped,
+		 (unsigned long long) e.heapInScope.load(std::memory_order_relaxed),
+		 (unsigned long long) e.heapOutside.load(std::memory_order_relaxed),
+		 samples ? 100.0 * scoped / samples : 0.0, scope);
+    for (int f = 0; (f < cheap::stack_table::Depth) && e.frames[f]; f++) {
+      char frame[256];
+      codeName(e.frames[f], frame, sizeof(frame));
+      n += snprintf(buf + n, sizeof(buf) - n, "%s%s", f ? " < " : "", frame);
+      if (n >= (int) sizeof(buf) - 1) {
+	n = sizeof(buf) - 1;
+	break;
+      }
+    }
+    buf[n++] = '\n';
+    writeAll(fd, buf, n);
+  }
+  closeReport(fd);
+}
+
+/// Copy s into a JSON string body.
+static void jsonEscape(const char * s, char * out, size_t size) {
+  size_t n = 0;
+  for (; *s && (n + 2 < size); s++) {
+    if ((*s == '"') || (*s == '\\')) {
+      out[n++] = '\\';
+    }
+    out[n++] = ((unsigned char) *s < ' ') ? ' ' : *s;
+  }
+  out[n] = '\0';
+}
+
+__attribute__((destructor)) static void writeTrace() {
+  if (!tracing || !traceRings.load()) {
+    return;
+  }
+  char path[256];
+  auto * file = getenv("CHEAP_TRACE_FILE");
+  if (file && *file) {
+    snprintf(path, sizeof(path), "%s", file);
+  } else {
+    snprintf(path, sizeof(path), "cheap-trace.%d.json", getpid());
+  }
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return;
+  }
+  static char names[cheap::scope_sites::MaxSites][256];
+  for (int i = 0; i < scopeSites.count(); i++) {
+    char name[256];
+    siteName(scopeSites[i], name, sizeof(name));
+    jsonEscape(name, names[i], sizeof(names[i]));
+  }
+  writeAll(fd, "{\"traceEvents\":[\n", 17);
+  bool first = true;
+  auto pid = getpid();
+  for (auto * r = traceRings.load(std::memory_order_acquire); r; r = r->next) {
+    r->forEach([&](const cheap::trace_ring::event& e) {
+      char buf[512];
+      int n;
+      // Timestamps and durations are in microseconds.
+      auto ts = e.start / 1000;
+      auto tsFraction = e.start % 1000;
+      auto dur = e.duration / 1000;
+      auto durFraction = e.duration % 1000;
+      if (e.kind == cheap::trace_ring::Scope) {
+	n = snprintf(buf, sizeof(buf), "%s{\"name\":\"%s\",\"cat\":\"scope\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+		     "\"ts\":%llu.%03u,\"dur\":%llu.%03u,\"args\":{\"bytes\":%llu,\"allocations\":%u,\"spills\":%u}}",
+		     first ? "" : ",\n", names[e.site], pid, r->tid,
+		     (unsigned long long) ts, (unsigned) tsFraction, (unsigned long long) dur, (unsigned) durFraction,
+		     (unsigned long long) e.bytes, e.allocations, e.spills);
+      } else if (e.kind == cheap::trace_ring::Refill) {
+	n = snprintf(buf, sizeof(buf), "%s{\"name\":\"refill\",\"cat\":\"region\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+		     "\"ts\":%llu.%03u,\"dur\":%llu.%03u,\"args\":{\"bytes\":%llu}}",
+		     first ? "" : ",\n", pid, r->tid,
+		     (unsigned long long) ts, (unsigned) tsFraction, (unsigned long long) dur, (unsigned) durFraction,
+		     (unsigned long long) e.bytes);
+      } else {
+	// Chunks are released without their size.
+	n = snprintf(buf, sizeof(buf), "%s{\"name\":\"release\",\"cat\":\"region\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+		     "\"ts\":%llu.%03u,\"dur\":%llu.%03u}",
+		     first ? "" : ",\n", pid, r->tid,
+		     (unsigned long long) ts, (unsigned) tsFraction, (unsigned long long) dur, (unsigned) durFraction);
+      }
+      first = false;
+      writeAll(fd, buf, n);
+    });
+  }
+  writeAll(fd, "\n]}\n", 4);
+  close(fd);
+}
+
 extern "C" void __attribute__((always_inline)) xxmalloc_lock() { getTheCustomHeap().lock(); }
 
 extern "C" void __attribute__((always_inline)) xxmalloc_unlock() {
@@ -111,5 +1672,65 @@ extern "C" void __attribute__((always_inline)) xxmalloc_unlock() {
 }
 
 #if !defined(__APPLE__)
+
+// Our calloc replaces the wrapper's.
+#define calloc cheap_wrapped_calloc
 #include "gnuwrapper.cpp"
+#undef calloc
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
+/// Clear sz bytes of recycled region space at ptr. Large blocks are
+/// cleared with non-temporal stores, so they do not evict the caller's
+/// working set on the way.
+static void zero(void * ptr, size_t sz) {
+#if defined(__x86_64__)
+  enum { NonTemporalSize = 256 * 1024 };
+  if (sz >= NonTemporalSize) {
+    auto * p = (char *) ptr;
+    auto * end = p + sz;
+    // Clear up to a 16-byte boundary, then stream, then the tail.
+    auto * aligned = (char *) (((uintptr_t) p + 15) & ~(uintptr_t) 15);
+    memset(p, 0, aligned - p);
+    auto z = _mm_setzero_si128();
+    for (p = aligned; p + 64 <= end; p += 64) {
+      _mm_stream_si128((__m128i *) p, z);
+      _mm_stream_si128((__m128i *) (p + 16), z);
+      _mm_stream_si128((__m128i *) (p + 32), z);
+      _mm_stream_si128((__m128i *) (p + 48), z);
+    }
+    _mm_sfence();
+    memset(p, 0, end - p);
+    return;
+  }
+#endif
+  memset(ptr, 0, sz);
+}
+
+/// calloc, skipping the clear when a scope's region serves the
+/// request from memory it has never handed out (see untouched()).
+extern "C" __attribute__((visibility("default"))) void * calloc(size_t n, size_t size) __THROW {
+  size_t sz;
+  if (__builtin_mul_overflow(n, size, &sz)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  auto * ptr = xxmalloc(sz);
+  if (!ptr) {
+    return nullptr;
+  }
+  auto ci = current();
+  if (ci && ci->in_cheap && !ci->freelist && (ownerMap.tag(ptr) == cheap::owner_map::Scope)) {
+    // Served by a region. Everything else is cleared as the heap would.
+    if (!ci->untouched(ptr)) {
+      zero(ptr, sz);
+    }
+    return ptr;
+  }
+  memset(ptr, 0, sz);
+  return ptr;
+}
+
 #endif
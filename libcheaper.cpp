@@ -55,11 +55,19 @@ public:
   void unlock() {}
 };
 
+// NextHeap keeps its state in constant-initialized statics, so this
+// needs no guard variable.
+static CustomHeapType thang;
+
 CustomHeapType& getTheCustomHeap() {
-  static CustomHeapType thang;
   return thang;
 }
 
+// Resolve the next allocator at load time rather than on first use.
+__attribute__((constructor)) static void initializeTheCustomHeap() {
+  NextHeap::initialize();
+}
+
 static std::atomic<long> samples{0};
 static std::atomic<int> busy{0};
 #define USE_LOCKS 0
@@ -0,0 +1,68 @@
+/* -*- C++ -*- */
+
+#pragma once
+
+#ifndef LIVESTATS_H
+#define LIVESTATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+
+#include "scopestats.h"
+
+namespace cheap {
+
+  /**
+   * The page of per-scope-site counters that libcheap publishes in a
+   * shared memory segment (see CHEAP_LIVE in README.md), for cheap-top
+   * to read while the program runs. libcheap adds each scope
+   * instance's totals when it ends, with relaxed atomics; readers see
+   * counters that only grow (except peak, a maximum).
+   */
+  class live_stats {
+  public:
+
+    enum { Magic = 0x70616863 }; // "chap"
+    enum { Version = 1 };
+    enum { MaxSites = scope_sites::MaxSites };
+    enum { NameSize = 112 };
+
+    class site {
+    public:
+      char name[NameSize];            // file:line or function+offset
+      std::atomic<uint64_t> entries;  // scope instances ended
+      std::atomic<uint64_t> bytes;    // bytes requested in them
+      std::atomic<uint64_t> peak;     // most bytes in one instance
+      std::atomic<uint64_t> refills;  // region chunks obtained
+      std::atomic<uint64_t> spills;   // requests served by the heap
+      std::atomic<uint64_t> ignoredFrees;
+
+      void add(uint64_t b, uint64_t r, uint64_t s, uint64_t f) {
+	entries.fetch_add(1, std::memory_order_relaxed);
+	bytes.fetch_add(b, std::memory_order_relaxed);
+	refills.fetch_add(r, std::memory_order_relaxed);
+	spills.fetch_add(s, std::memory_order_relaxed);
+	ignoredFrees.fetch_add(f, std::memory_order_relaxed);
+	auto p = peak.load(std::memory_order_relaxed);
+	while ((b > p) && !peak.compare_exchange_weak(p, b, std::memory_order_relaxed)) {}
+      }
+    };
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t pid;
+    /// Sites [0, count) have been named.
+    std::atomic<uint32_t> count;
+    site sites[MaxSites];
+
+    /// The shm_open name of the segment for process pid.
+    static void segmentName(char * buf, size_t size, int pid) {
+      snprintf(buf, size, "/cheap-stats.%d", pid);
+    }
+  };
+
+}
+
+#endif
@@ -5,6 +5,8 @@
 
 #include <dlfcn.h>
 
+#include <atomic>
+
 #if defined(__APPLE__)
 
 class NextHeap {
@@ -26,6 +28,7 @@ public:
   inline size_t getSize(void * ptr) {
     return ::malloc_size(ptr);
   }
+  static void initialize() {}
 };
 
 #else
@@ -37,100 +40,166 @@ extern "C" {
   typedef void * memalignFn(size_t, size_t);
 }
 
-class NextHeap {
-private:
+/// Serves requests that arrive before the next allocator's symbols are
+/// resolved, or while they are being resolved (dlsym can allocate).
+/// Its memory is never reused.
+class BootstrapHeap {
 public:
-  enum { Alignment = alignof(max_align_t) };
-  NextHeap()
-    : _inMalloc (false),
-      _inFree (false),
-      _inMemalign (false),
-      _malloc (nullptr),
-      _free (nullptr),
-      _memalign (nullptr),
-      _malloc_usable_size (nullptr)
-  {
+  enum { Size = 65536 };
+
+  static void * malloc(size_t sz) {
+    return memalign(alignof(max_align_t), sz);
   }
-  inline void * malloc(size_t sz) {
-    if (unlikely(_inMalloc)) {
-      // If we're in a recursive call, return null.
-      return 0;
-    }
-    if (unlikely(_malloc == nullptr)) {
-      return slowPathMalloc(sz);
+
+  static void * memalign(size_t alignment, size_t sz) {
+    if (alignment < alignof(max_align_t)) {
+      alignment = alignof(max_align_t);
     }
-    _inMalloc = true;
-    void * ptr = (*_malloc)(sz);
-    _inMalloc = false;
+    auto& used = usedBytes();
+    size_t offset = used.load(std::memory_order_relaxed);
+    size_t start;
+    do {
+      // Leave room for the size just below the object.
+      start = (offset + sizeof(size_t) + alignment - 1) & ~(alignment - 1);
+      if ((start + sz > Size) || (start + sz < start)) {
+	return nullptr;
+      }
+    } while (!used.compare_exchange_weak(offset, start + sz));
+    auto * ptr = buffer() + start;
+    ((size_t *) ptr)[-1] = sz;
     return ptr;
   }
+
+  static inline bool contains(const void * ptr) {
+    return ((const char *) ptr >= buffer()) && ((const char *) ptr < buffer() + Size);
+  }
+
+  static size_t getSize(void * ptr) {
+    return ((size_t *) ptr)[-1];
+  }
+
+private:
+  static inline char * buffer() {
+    alignas(4096) static char buf[Size];
+    return buf;
+  }
+
+  static inline std::atomic<size_t>& usedBytes() {
+    static std::atomic<size_t> used {0};
+    return used;
+  }
+};
+
+class NextHeap {
+public:
+  enum { Alignment = alignof(max_align_t) };
+
+  // Once resolved, each call is a single indirect call.
+  inline void * malloc(size_t sz) {
+    return (*next()._malloc.load(std::memory_order_relaxed))(sz);
+  }
   inline void * memalign(size_t alignment, size_t sz) {
-    if (unlikely(_memalign == nullptr)) {
-      return slowPathMemalign(alignment, sz);
-    }
-    return (*_memalign)(alignment, sz);
+    return (*next()._memalign.load(std::memory_order_relaxed))(alignment, sz);
   }
   inline bool free(void * ptr) {
-    if (unlikely(_free == nullptr)) {
-      return slowPathFree(ptr);
+    if (unlikely(BootstrapHeap::contains(ptr))) {
+      return true;
     }
-    (*_free)(ptr);
+    (*next()._free.load(std::memory_order_relaxed))(ptr);
     return true;
   }
-
   inline size_t getSize(void * ptr) {
-    if (unlikely(!_malloc_usable_size)) {
-      if (_inMalloc) {
-	// If we're in a recursive call, return 0 for the size.
-	return 0;
-      }
-      _inMalloc = true;
-      *(void **)(&_malloc_usable_size) = dlsym(RTLD_NEXT, "malloc_usable_size");
-      _inMalloc = false;
+    if (unlikely(BootstrapHeap::contains(ptr))) {
+      return BootstrapHeap::getSize(ptr);
     }
-    return (*_malloc_usable_size)(ptr);
+    return (*next()._malloc_usable_size.load(std::memory_order_relaxed))(ptr);
   }
-  
+
+  /// Resolve the next allocator now; call from a load-time constructor.
+  static void initialize() {
+    resolve();
+  }
+
 private:
 
-  bool slowPathFree(void * ptr) {
-    if (_inFree) {
+  /// The next allocator's entry points. These start out at the
+  /// bootstrap versions below, which resolve the real ones on first use.
+  class symbols {
+  public:
+    std::atomic<mallocFn *> _malloc { bootstrapMalloc };
+    std::atomic<freeFn *> _free { bootstrapFree };
+    std::atomic<memalignFn *> _memalign { bootstrapMemalign };
+    std::atomic<mallocusablesizeFn *> _malloc_usable_size { bootstrapGetSize };
+  };
+
+  // Constant-initialized: no guard variable, and valid before any
+  // constructor has run.
+  static inline symbols& next() {
+    static symbols s;
+    return s;
+  }
+
+  // Per thread, so one thread resolving never affects another.
+  static inline bool& resolving() {
+    static __thread bool r __attribute__((tls_model ("initial-exec")));
+    return r;
+  }
+
+  static bool resolve() {
+    auto& busy = resolving();
+    if (busy) {
+      // A recursive call from dlsym.
       return false;
     }
-    _inFree = true;
-    *(void **)(&_free) = dlsym(RTLD_NEXT, "free");
-    _inFree = false;
-    (*_free)(ptr);
+    busy = true;
+    // Welcome to the hideous incantation required to use dlsym with C++...
+    mallocFn * m;
+    freeFn * f;
+    memalignFn * ma;
+    mallocusablesizeFn * us;
+    *(void **)(&m) = dlsym(RTLD_NEXT, "malloc");
+    *(void **)(&f) = dlsym(RTLD_NEXT, "free");
+    *(void **)(&ma) = dlsym(RTLD_NEXT, "memalign");
+    *(void **)(&us) = dlsym(RTLD_NEXT, "malloc_usable_size");
+    busy = false;
+    if (!(m && f && ma && us)) {
+      return false;
+    }
+    auto& s = next();
+    s._free.store(f, std::memory_order_relaxed);
+    s._memalign.store(ma, std::memory_order_relaxed);
+    s._malloc_usable_size.store(us, std::memory_order_relaxed);
+    s._malloc.store(m, std::memory_order_release);
     return true;
   }
-  
-  void * slowPathMalloc(size_t sz) {
-    _inMalloc = true;
-    // Welcome to the hideous incantation required to use dlsym with C++...
-    *(void **)(&_malloc) = dlsym(RTLD_NEXT, "malloc");
-    _inMalloc = false;
-    return (*_malloc)(sz);
+
+  static void * bootstrapMalloc(size_t sz) {
+    if (resolve()) {
+      return (*next()._malloc.load(std::memory_order_acquire))(sz);
+    }
+    return BootstrapHeap::malloc(sz);
   }
 
-  void * slowPathMemalign(size_t alignment, size_t sz) {
-    if (_inMemalign) {
-      // If we're in a recursive call, return null.
-      return 0;
+  static void * bootstrapMemalign(size_t alignment, size_t sz) {
+    if (resolve()) {
+      return (*next()._memalign.load(std::memory_order_acquire))(alignment, sz);
     }
-    _inMemalign = true;
-    // Welcome to the hideous incantation required to use dlsym with C++...
-    *(void **)(&_memalign) = dlsym(RTLD_NEXT, "memalign");
-    _inMemalign = false;
-    return (*_memalign)(alignment, sz);
-  }
-
-  bool _inMalloc;
-  bool _inFree;
-  bool _inMemalign;
-  mallocFn * _malloc;
-  freeFn * _free;
-  memalignFn * _memalign;
-  mallocusablesizeFn * _malloc_usable_size;
+    return BootstrapHeap::memalign(alignment, sz);
+  }
+
+  static void bootstrapFree(void * ptr) {
+    // Only memory from the next allocator gets here (see free()).
+    if (ptr && resolve()) {
+      (*next()._free.load(std::memory_order_acquire))(ptr);
+    }
+  }
+
+  static size_t bootstrapGetSize(void * ptr) {
+    if (ptr && resolve()) {
+      return (*next()._malloc_usable_size.load(std::memory_order_acquire))(ptr);
+    }
+    return 0;
+  }
 };
 #endif
 
@@ -0,0 +1,382 @@
+/* -*- C++ -*- */
+
+#pragma once
+
+#ifndef NURSERY_H
+#define NURSERY_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "heaplayers.h"
+
+#include "common.hpp"
+#include "ownership.h"
+
+namespace cheap {
+
+  /**
+   * Automatic placement of short-lived allocations (libcheap's "auto"
+   * mode; see CHEAP_AUTO in README.md): Cheaper's lifetime analysis,
+   * done online.
+   *
+   * Outside scopes, one allocation in SampleRate is sampled: it comes
+   * from the normal heap, but its address, call site and the
+   * allocating thread's allocation count are recorded, so that its
+   * free yields a lifetime (measured in allocations by that thread;
+   * frees by another thread, and samples still live when a new one
+   * takes their slot, count as long-lived). Once a site has
+   * MinSamples samples, it is either placed (at least ShortPercent
+   * percent were short-lived) or rejected for good.
+   *
+   * Allocations from placed sites are bumped out of the thread's
+   * current nursery chunk, whose pages are tagged Nursery in
+   * theOwnerMap(). Each chunk counts its live objects and is recycled
+   * once it is full and all of them have been freed. An object freed
+   * long after its chunk filled up is a misprediction; a site with too
+   * many is rejected, and the nursery stops growing past MaxChunks
+   * (placed sites then use the heap until a chunk is recycled).
+   * A thread's current chunk is retired when the thread exits.
+   */
+  class auto_nursery {
+  public:
+
+    enum { ChunkSize = 256 * 1024 };
+    enum { MaxObjectSize = 4096 };
+    enum { MaxChunks = 64 };
+    enum { SampleRate = 64 };
+    enum { MinSamples = 32 };
+    enum { ShortPercent = 90 };
+    enum { ShortLifetime = 16384 }; // allocations
+    enum { LateEpochs = 16 }; // chunk fills before a free is "late"
+    enum { NumSites = 4096 };
+    enum { NumSamples = 4096 };
+
+    constexpr auto_nursery() {}
+
+    /// Allocate sz bytes for site from the nursery, or return nullptr
+    /// (the caller then uses the heap and calls sampled()).
+    inline void * malloc(uintptr_t site, size_t sz) {
+      auto& t = threadState();
+      t.allocations++;
+      if (unlikely((site == 0) || (sz > MaxObjectSize))) {
+	return nullptr;
+      }
+      auto * s = findSite(site);
+      if (!s) {
+	return nullptr;
+      }
+      auto state = s->state.load(std::memory_order_relaxed);
+      if (state == Placed) {
+	return nurseryMalloc(t, s, sz);
+      }
+      if ((state == Learning) && (--t.countdown <= 0)) {
+	t.countdown = SampleRate;
+	t.sampleSite = s;
+      }
+      return nullptr;
+    }
+
+    /// Record ptr, just allocated from the heap, if malloc() chose to
+    /// sample it.
+    inline void sampled(void * ptr) {
+      auto& t = threadState();
+      if (likely(t.sampleSite == nullptr)) {
+	return;
+      }
+      auto * s = t.sampleSite;
+      t.sampleSite = nullptr;
+      if (!ptr) {
+	return;
+      }
+      auto& e = _samples[sampleSlot(ptr)];
+      _sampleLock.lock();
+      auto * evicted = e.ptr.load(std::memory_order_relaxed) ? e.site : nullptr;
+      e.site = s;
+      e.thread = &t;
+      e.allocations = t.allocations;
+      e.ptr.store(ptr, std::memory_order_release);
+      _sampleLock.unlock();
+      if (unlikely(evicted != nullptr)) {
+	// Still live: dropping it would only let short lives vote.
+	countSample(evicted, false);
+      }
+    }
+
+    /// Note the free of a heap object (which may have been sampled).
+    inline void heapFree(void * ptr) {
+      auto& e = _samples[sampleSlot(ptr)];
+      if (likely((e.ptr.load(std::memory_order_relaxed) != ptr) || !ptr)) {
+	return;
+      }
+      finishSample(e, ptr);
+    }
+
+    /// Free an object in a Nursery page.
+    inline void free(void * ptr) {
+      auto * h = (header *) ptr - 1;
+      auto * c = chunkOf(ptr);
+      if (unlikely(c->retiredAt && (_epoch.load(std::memory_order_relaxed) - c->retiredAt > LateEpochs))) {
+	mispredicted(&_sites[h->site]);
+      }
+      if (c->live.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+	recycle(c);
+      }
+    }
+
+    inline size_t getSize(void * ptr) {
+      return ((header *) ptr - 1)->size;
+    }
+
+    inline bool enabled() const {
+      return _enabled;
+    }
+
+    void enable(bool on) {
+      if (on && !_exitKeyCreated) {
+	_exitKeyCreated = (pthread_key_create(&_exitKey, threadExit) == 0);
+      }
+      _enabled = on;
+    }
+
+  private:
+
+    enum { Learning = 0, Placed = 1, Rejected = 2 };
+
+    class site_entry {
+    public:
+      std::atomic<uintptr_t> site {0};
+      std::atomic<uint8_t> state {Learning};
+      std::atomic<uint32_t> samples {0};
+      std::atomic<uint32_t> shortLived {0};
+      std::atomic<uint32_t> placed {0};
+      std::atomic<uint32_t> late {0};
+    };
+
+    class chunk {
+    public:
+      std::atomic<long> live; // objects, plus one while being bumped
+      uint64_t retiredAt;     // epoch when filled (0 = still active)
+      chunk * next;
+      char * pointer;
+      char * end;
+    };
+
+    class thread_state {
+    public:
+      chunk * current;
+      uint64_t allocations;
+      int countdown;
+      site_entry * sampleSite;
+      bool exitRegistered;
+    };
+
+    class sample {
+    public:
+      std::atomic<void *> ptr {nullptr};
+      site_entry * site {nullptr};
+      thread_state * thread {nullptr};
+      uint64_t allocations {0};
+    };
+
+    class header {
+    public:
+      uint32_t size;
+      uint32_t site;
+      uint64_t padding;
+    };
+
+    static_assert(sizeof(header) % MIN_ALIGNMENT == 0, "Nursery objects must stay aligned.");
+
+    static inline thread_state& threadState() {
+      static __thread thread_state t __attribute__((tls_model ("initial-exec")));
+      return t;
+    }
+
+    static inline chunk * chunkOf(void * ptr) {
+      return (chunk *) ((uintptr_t) ptr & ~((uintptr_t) ChunkSize - 1));
+    }
+
+    static inline size_t sampleSlot(const void * ptr) {
+      return (((uintptr_t) ptr >> 4) * 0x9E3779B97F4A7C15ULL) >> 52; // NumSamples = 2^12
+    }
+
+    /// The entry for site, creating it if need be (nullptr if full).
+    inline site_entry * findSite(uintptr_t site) {
+      auto i = (site * 0x9E3779B97F4A7C15ULL) >> 52; // NumSites = 2^12
+      for (int probe = 0; probe < 8; probe++) {
+	auto& e = _sites[(i + probe) & (NumSites - 1)];
+	auto current = e.site.load(std::memory_order_acquire);
+	if (current == site) {
+	  return &e;
+	}
+	if ((current == 0) && e.site.compare_exchange_strong(current, site)) {
+	  return &e;
+	}
+	if (current == site) {
+	  return &e;
+	}
+      }
+      return nullptr;
+    }
+
+    void __attribute__((noinline)) finishSample(sample& e, void * ptr) {
+      _sampleLock.lock();
+      if (e.ptr.load(std::memory_order_relaxed) != ptr) {
+	_sampleLock.unlock();
+	return;
+      }
+      auto * s = e.site;
+      auto& t = threadState();
+      bool isShort = (e.thread == &t) && (t.allocations - e.allocations < ShortLifetime);
+      e.ptr.store(nullptr, std::memory_order_relaxed);
+      _sampleLock.unlock();
+      countSample(s, isShort);
+    }
+
+    /// Count one finished sample for s; decide s once it has MinSamples.
+    void countSample(site_entry * s, bool isShort) {
+      if (isShort) {
+	s->shortLived.fetch_add(1, std::memory_order_relaxed);
+      }
+      auto n = s->samples.fetch_add(1, std::memory_order_relaxed) + 1;
+      if (n == MinSamples) {
+	bool place = s->shortLived.load(std::memory_order_relaxed) * 100 >= (uint32_t) ShortPercent * MinSamples;
+	s->state.store(place ? Placed : Rejected, std::memory_order_relaxed);
+      }
+    }
+
+    void mispredicted(site_entry * s) {
+      auto late = s->late.fetch_add(1, std::memory_order_relaxed) + 1;
+      auto placed = s->placed.load(std::memory_order_relaxed);
+      if ((late >= MinSamples) && (late * 100 > placed * (100 - ShortPercent))) {
+	s->state.store(Rejected, std::memory_order_relaxed);
+      }
+    }
+
+    void * nurseryMalloc(thread_state& t, site_entry * s, size_t sz) {
+      sz = (sz + MIN_ALIGNMENT - 1) & ~(MIN_ALIGNMENT - 1);
+      auto total = sz + sizeof(header);
+      auto * c = t.current;
+      if (unlikely(!c || ((size_t) (c->end - c->pointer) < total))) {
+	if (unlikely(_exhausted.load(std::memory_order_relaxed))) {
+	  // No chunk to be had: give this one back, and skip the lock.
+	  retire(t);
+	  return nullptr;
+	}
+	c = newChunk(t);
+	if (!c) {
+	  return nullptr;
+	}
+      }
+      auto * h = (header *) c->pointer;
+      c->pointer += total;
+      c->live.fetch_add(1, std::memory_order_relaxed);
+      h->size = (uint32_t) sz;
+      h->site = (uint32_t) (s - _sites);
+      s->placed.fetch_add(1, std::memory_order_relaxed);
+      return h + 1;
+    }
+
+    /// Retire the thread's current chunk, if any.
+    void retire(thread_state& t) {
+      if (t.current) {
+	auto * old = t.current;
+	t.current = nullptr;
+	old->retiredAt = _epoch.fetch_add(1, std::memory_order_relaxed) + 1;
+	if (old->live.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+	  recycle(old);
+	}
+      }
+    }
+
+    /// Runs at thread exit (once the thread has had a chunk), so that
+    /// exited threads do not hold on to chunks.
+    static void threadExit(void * nursery) {
+      auto& t = threadState();
+      t.exitRegistered = false;
+      static_cast<auto_nursery *>(nursery)->retire(t);
+    }
+
+    /// Retire the thread's current chunk (if any) and start a new one.
+    chunk * __attribute__((noinline)) newChunk(thread_state& t) {
+      retire(t);
+      _poolLock.lock();
+      auto * c = _pool;
+      if (c) {
+	_pool = c->next;
+      } else if (_chunks < MaxChunks) {
+	c = mapChunk();
+	if (c) {
+	  _chunks++;
+	}
+      }
+      if (!c) {
+	_exhausted.store(true, std::memory_order_relaxed);
+      }
+      _poolLock.unlock();
+      if (!c) {
+	return nullptr;
+      }
+      c->live.store(1, std::memory_order_relaxed);
+      c->retiredAt = 0;
+      c->next = nullptr;
+      c->pointer = (char *) c + sizeof(chunk_space);
+      c->end = (char *) c + ChunkSize;
+      t.current = c;
+      if (unlikely(!t.exitRegistered) && _exitKeyCreated) {
+	t.exitRegistered = true;
+	pthread_setspecific(_exitKey, this);
+      }
+      return c;
+    }
+
+    void recycle(chunk * c) {
+      _poolLock.lock();
+      c->next = _pool;
+      _pool = c;
+      _exhausted.store(false, std::memory_order_relaxed);
+      _poolLock.unlock();
+    }
+
+    /// Map a ChunkSize-aligned chunk and tag it as nursery memory.
+    static chunk * mapChunk() {
+      auto * buf = (char *) HL::MmapWrapper::map(2 * ChunkSize);
+      if (!buf) {
+	return nullptr;
+      }
+      auto * aligned = (char *) (((uintptr_t) buf + ChunkSize - 1) & ~((uintptr_t) ChunkSize - 1));
+      if (aligned > buf) {
+	HL::MmapWrapper::unmap(buf, aligned - buf);
+      }
+      HL::MmapWrapper::unmap(aligned + ChunkSize, (buf + 2 * ChunkSize) - (aligned + ChunkSize));
+      theOwnerMap().set(aligned, ChunkSize, owner_map::Nursery);
+      return (chunk *) aligned;
+    }
+
+    // The chunk header, padded so objects stay aligned.
+    class chunk_space {
+    public:
+      alignas(max_align_t) char space[sizeof(chunk)];
+    };
+
+    bool _enabled {false};
+    site_entry _sites[NumSites] {};
+    sample _samples[NumSamples] {};
+    spin_lock _sampleLock;
+    spin_lock _poolLock;
+    chunk * _pool {nullptr};
+    int _chunks {0};
+    /// Set while every chunk is in use (and MaxChunks are mapped).
+    std::atomic<bool> _exhausted {false};
+    std::atomic<uint64_t> _epoch {0};
+    bool _exitKeyCreated {false};
+    pthread_key_t _exitKey {};
+  };
+
+}
+
+#endif
@@ -0,0 +1,411 @@
+/* -*- C++ -*- */
+
+#pragma once
+
+#ifndef OWNERSHIP_H
+#define OWNERSHIP_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <atomic>
+
+#include "heaplayers.h"
+#include "common.hpp"
+#include "probes.h"
+
+namespace cheap {
+
+  /// Records which pages hold memory handed out by a cheap heap, so that
+  /// frees can be routed by address in O(1): a shift, two loads and a
+  /// compare. Leaves are mapped lazily the first time a page in their
+  /// range is registered and are never released. Each page has a one-byte
+  /// tag: Foreign, Scope, Nursery (see nursery.h), Shared (see
+  /// fixed_range), Dead (see retire), or a value from FirstFreeTag up
+  /// chosen by another
+  /// heap (see generalheap.h). Scope pages also record the id of the
+  /// heap that registered them (see OwnedMmapHeap::id()).
+  class owner_map {
+  public:
+
+    enum { Foreign = 0, Scope = 1, Nursery = 2, Shared = 3, Dead = 4, FirstFreeTag = 5 };
+
+    enum { PageShift = 12 };
+    enum { AddressBits = 48 };
+    enum { LeafBits = 18 };
+    enum { TopBits = AddressBits - PageShift - LeafBits };
+
+    /// A caller-supplied buffer registered as scope memory (see
+    /// addFixed), with the tag its memory had before.
+    class fixed_range {
+    public:
+      uintptr_t start {0};
+      uintptr_t end {0};
+      uint8_t saved {Foreign};
+      uintptr_t savedOwner {0};
+      fixed_range * next {nullptr};
+    };
+
+    constexpr owner_map() {}
+
+    inline uint8_t tag(const void * ptr) const {
+      auto t = pageTag(ptr);
+      if (unlikely(t == Shared)) {
+	return sharedTag((uintptr_t) ptr);
+      }
+      return t;
+    }
+
+    /// The id of the heap that registered the scope memory at ptr
+    /// (0 for fixed buffers).
+    inline uintptr_t owner(const void * ptr) const {
+      if (unlikely(pageTag(ptr) == Shared)) {
+	return sharedOwner((uintptr_t) ptr);
+      }
+      return pageOwner(ptr);
+    }
+
+    /// True iff ptr is scope memory.
+    inline bool owns(const void * ptr) const {
+      return tag(ptr) == Scope;
+    }
+
+    /// Mark every page overlapping [ptr, ptr + sz) as scope memory
+    /// registered by the heap with the given id.
+    void add(const void * ptr, size_t sz, uintptr_t owner = 0) {
+      setOwner(ptr, sz, owner);
+      set(ptr, sz, Scope);
+    }
+
+    /// Release the pages of [ptr, ptr + sz) (page aligned scope memory)
+    /// but keep them reserved and tagged Dead, so that frees of objects
+    /// that outlived the heap that owned them are recognized (and
+    /// ignored) instead of reaching the system allocator. reuse() hands
+    /// them out again.
+    void retire(void * ptr, size_t sz) {
+      auto pages = (sz + PageMask) >> PageShift;
+      set(ptr, pages << PageShift, Dead);
+      madvise(ptr, pages << PageShift, MADV_DONTNEED);
+      _deadLock.lock();
+      putDead((dead_range *) ptr, pages);
+      _deadLock.unlock();
+    }
+
+    /// At least sz bytes of zeroed, page aligned memory that was
+    /// retired, still tagged Dead, or nullptr if there are none.
+    void * reuse(size_t sz) {
+      auto pages = (sz + PageMask) >> PageShift;
+      dead_range * r = nullptr;
+      _deadLock.lock();
+      for (auto b = binOf(pages); (b < DeadBins) && !r; b++) {
+	for (auto ** p = &_dead[b]; *p; p = &(*p)->next) {
+	  if ((*p)->pages >= pages) {
+	    r = *p;
+	    *p = r->next;
+	    break;
+	  }
+	}
+      }
+      if (r && (r->pages > pages)) {
+	putDead((dead_range *) ((char *) r + (pages << PageShift)), r->pages - pages);
+      }
+      _deadLock.unlock();
+      if (r) {
+	memset(r, 0, sizeof(dead_range));
+      }
+      return r;
+    }
+
+    /// Forget every page overlapping [ptr, ptr + sz).
+    void remove(const void * ptr, size_t sz) {
+      set(ptr, sz, Foreign);
+    }
+
+    /// Tag every page overlapping [ptr, ptr + sz).
+    void set(const void * ptr, size_t sz, uint8_t value) {
+      if (sz == 0) {
+	return;
+      }
+      auto first = reinterpret_cast<uintptr_t>(ptr) >> PageShift;
+      auto last = (reinterpret_cast<uintptr_t>(ptr) + sz - 1) >> PageShift;
+      while (first <= last) {
+	auto * leaf = getLeaf(_top, first >> LeafBits, value != 0);
+	auto start = first & LeafMask;
+	auto end = ((last >> LeafBits) == (first >> LeafBits)) ? (last & LeafMask) : (uintptr_t) LeafMask;
+	if (leaf) {
+	  memset(leaf + start, value, end - start + 1);
+	}
+	first += end - start + 1;
+      }
+    }
+
+    /// Record the owner of every page overlapping [ptr, ptr + sz).
+    void setOwner(const void * ptr, size_t sz, uintptr_t owner) {
+      if (sz == 0) {
+	return;
+      }
+      auto first = reinterpret_cast<uintptr_t>(ptr) >> PageShift;
+      auto last = (reinterpret_cast<uintptr_t>(ptr) + sz - 1) >> PageShift;
+      while (first <= last) {
+	auto * leaf = getLeaf(_owners, first >> LeafBits, owner != 0);
+	auto start = first & LeafMask;
+	auto end = ((last >> LeafBits) == (first >> LeafBits)) ? (last & LeafMask) : (uintptr_t) LeafMask;
+	for (auto i = start; leaf && (i <= end); i++) {
+	  leaf[i] = owner;
+	}
+	first += end - start + 1;
+      }
+    }
+
+    /// Mark the buffer [ptr, ptr + sz) as scope memory until
+    /// removeFixed(r). Pages it covers entirely are tagged Scope; the
+    /// (at most two) pages it shares with other memory are tagged
+    /// Shared, and tag() looks those up in the list of fixed ranges,
+    /// so neighbouring objects keep their tag. A buffer is one
+    /// allocation (or array), so the tag of its first byte is taken to
+    /// be that of all of its pages, and is restored by removeFixed().
+    void addFixed(fixed_range& r, const void * ptr, size_t sz) {
+      if (sz == 0) {
+	return;
+      }
+      r.start = (uintptr_t) ptr;
+      r.end = r.start + sz;
+      _fixedLock.lock();
+      r.saved = tagLocked(r.start, &r.savedOwner);
+      r.next = _fixed;
+      _fixed = &r;
+      forEdge(r, [&](uintptr_t page) { setPage(page, Shared); });
+      setInterior(r, Scope, 0);
+      _fixedLock.unlock();
+    }
+
+    /// Undo addFixed(r).
+    void removeFixed(fixed_range& r) {
+      if (r.start == r.end) {
+	return;
+      }
+      _fixedLock.lock();
+      for (auto ** p = &_fixed; *p; p = &(*p)->next) {
+	if (*p == &r) {
+	  *p = r.next;
+	  break;
+	}
+      }
+      forEdge(r, [&](uintptr_t page) {
+	// Pages shared with another registered buffer stay Shared.
+	if (!edgeOf(page)) {
+	  setPage(page, r.saved);
+	}
+      });
+      setInterior(r, r.saved, r.savedOwner);
+      r.start = r.end = 0;
+      _fixedLock.unlock();
+    }
+
+  private:
+
+    enum { PageMask = (1UL << PageShift) - 1 };
+    enum { DeadBins = AddressBits - PageShift };
+
+    /// A retired range, recorded in its own first page.
+    class dead_range {
+    public:
+      size_t pages;
+      dead_range * next;
+    };
+
+    /// Retired ranges of [2^b, 2^(b+1)) pages are kept in bin b.
+    static unsigned binOf(size_t pages) {
+      return (sizeof(unsigned long) * 8 - 1) - __builtin_clzl(pages);
+    }
+
+    void putDead(dead_range * r, size_t pages) {
+      auto b = binOf(pages);
+      r->pages = pages;
+      r->next = _dead[b];
+      _dead[b] = r;
+    }
+    enum { TopMask = (1UL << TopBits) - 1 };
+    enum { LeafMask = (1UL << LeafBits) - 1 };
+
+    inline uint8_t pageTag(const void * ptr) const {
+      auto page = reinterpret_cast<uintptr_t>(ptr) >> PageShift;
+      auto * leaf = _top[(page >> LeafBits) & TopMask].load(std::memory_order_acquire);
+      return leaf ? leaf[page & LeafMask] : (uint8_t) Foreign;
+    }
+
+    inline uintptr_t pageOwner(const void * ptr) const {
+      auto page = reinterpret_cast<uintptr_t>(ptr) >> PageShift;
+      auto * leaf = _owners[(page >> LeafBits) & TopMask].load(std::memory_order_acquire);
+      return leaf ? leaf[page & LeafMask] : 0;
+    }
+
+    void setPage(uintptr_t page, uint8_t value) {
+      set((void *) (page << PageShift), 1, value);
+    }
+
+    /// Call fn on each page that r only partly covers.
+    template <class Fn>
+    static void forEdge(const fixed_range& r, Fn fn) {
+      auto first = r.start >> PageShift;
+      auto last = (r.end - 1) >> PageShift;
+      if (r.start & PageMask) {
+	fn(first);
+      }
+      if ((r.end & PageMask) && ((last != first) || !(r.start & PageMask))) {
+	fn(last);
+      }
+    }
+
+    /// Tag (and set the owner of) the pages r covers entirely.
+    void setInterior(const fixed_range& r, uint8_t value, uintptr_t owner) {
+      auto lo = (r.start + PageMask) >> PageShift;
+      auto hi = r.end >> PageShift;
+      if (lo < hi) {
+	setOwner((void *) (lo << PageShift), (hi - lo) << PageShift, owner);
+	set((void *) (lo << PageShift), (hi - lo) << PageShift, value);
+      }
+    }
+
+    /// True iff a registered buffer only partly covers page.
+    bool edgeOf(uintptr_t page) const {
+      for (auto * r = _fixed; r; r = r->next) {
+	bool found = false;
+	forEdge(*r, [&](uintptr_t p) { found = found || (p == page); });
+	if (found) {
+	  return true;
+	}
+      }
+      return false;
+    }
+
+    uint8_t __attribute__((noinline)) sharedTag(uintptr_t addr) const {
+      _fixedLock.lock();
+      auto t = tagLocked(addr);
+      _fixedLock.unlock();
+      return t;
+    }
+
+    uintptr_t __attribute__((noinline)) sharedOwner(uintptr_t addr) const {
+      uintptr_t owner;
+      _fixedLock.lock();
+      tagLocked(addr, &owner);
+      _fixedLock.unlock();
+      return owner;
+    }
+
+    /// Scope if addr is in a fixed buffer; otherwise, on a Shared page,
+    /// the tag (and owner) saved by the oldest buffer on it (an inner
+    /// buffer saves its outer one's Scope).
+    uint8_t tagLocked(uintptr_t addr, uintptr_t * owner = nullptr) const {
+      auto t = pageTag((void *) addr);
+      auto o = pageOwner((void *) addr);
+      if (t == Shared) {
+	t = Foreign;
+	o = 0;
+	for (auto * r = _fixed; r; r = r->next) {
+	  if ((addr >= r->start) && (addr < r->end)) {
+	    t = Scope;
+	    o = 0;
+	    break;
+	  }
+	  forEdge(*r, [&](uintptr_t p) {
+	    if (p == (addr >> PageShift)) {
+	      t = r->saved;
+	      o = r->savedOwner;
+	    }
+	  });
+	}
+      }
+      if (owner) {
+	*owner = o;
+      }
+      return t;
+    }
+
+    template <class T>
+    static T * getLeaf(std::atomic<T *> * top, uintptr_t index, bool create) {
+      auto & slot = top[index & TopMask];
+      auto * leaf = slot.load(std::memory_order_acquire);
+      if (leaf || !create) {
+	return leaf;
+      }
+      auto * fresh = (T *) HL::MmapWrapper::map(sizeof(T) << LeafBits);
+      if (!fresh) {
+	return nullptr;
+      }
+      if (!slot.compare_exchange_strong(leaf, fresh)) {
+	// Somebody else installed this leaf first.
+	HL::MmapWrapper::unmap(fresh, sizeof(T) << LeafBits);
+	return leaf;
+      }
+      return fresh;
+    }
+
+    std::atomic<uint8_t *> _top[1UL << TopBits] {};
+    std::atomic<uintptr_t *> _owners[1UL << TopBits] {};
+    mutable spin_lock _fixedLock;
+    fixed_range * _fixed {nullptr};
+    spin_lock _deadLock;
+    dead_range * _dead[DeadBins] {};
+  };
+
+}
+
+#if CHEAP_HEADER_ONLY
+inline cheap::owner_map& theOwnerMap() {
+  static cheap::owner_map map;
+  return map;
+}
+#else
+extern cheap::owner_map& theOwnerMap();
+#endif
+
+/// Like SizedMmapHeap, but registers everything it maps in
+/// theOwnerMap(), and retires (rather than unmaps) what it frees.
+class OwnedMmapHeap {
+public:
+
+  enum { Alignment = alignof(max_align_t) };
+
+  inline void * malloc(size_t sz) {
+    auto * h = (header *) theOwnerMap().reuse(sz + sizeof(header));
+    if (!h) {
+      h = (header *) HL::MmapWrapper::map(sz + sizeof(header));
+    }
+    if (!h) {
+      return nullptr;
+    }
+    h->size = sz;
+    theOwnerMap().add(h, sz + sizeof(header), id());
+    CHEAP_PROBE2(chunk_map, h, sz + sizeof(header));
+    return h + 1;
+  }
+
+  inline bool free(void * ptr) {
+    auto * h = (header *) ptr - 1;
+    auto sz = h->size + sizeof(header);
+    CHEAP_PROBE2(chunk_unmap, h, sz);
+    theOwnerMap().retire(h, sz);
+    return true;
+  }
+
+  inline size_t getSize(void * ptr) {
+    return ((header *) ptr - 1)->size;
+  }
+
+  /// The owner id of everything this heap maps (see owner_map::owner).
+  inline uintptr_t id() const {
+    return (uintptr_t) this;
+  }
+
+private:
+
+  class header {
+  public:
+    alignas(max_align_t) size_t size;
+  };
+};
+
+#endif
@@ -0,0 +1,230 @@
+/* -*- C++ -*- */
+
+#pragma once
+
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "scopestats.h"
+
+namespace cheap {
+
+  /**
+   * One thread's set of NumPerfCounters counters, opened with
+   * perf_event_open for that thread (user mode only) as one group led
+   * by the first, so the kernel schedules them onto the PMU together.
+   * Hardware counters (cycles, instructions, L1D, LLC and dTLB misses)
+   * are read with rdpmc where the kernel allows it and the group has
+   * never been multiplexed; otherwise the group is read in one call
+   * and scaled by its time enabled over time running. Where there is
+   * no PMU (as in many containers and VMs), the Software set stands
+   * in. A counter that cannot be opened (or added to the group) reads
+   * as zero.
+   */
+  class perf_counters {
+  public:
+
+    enum kind { None = 0, Hardware = 1, Software = 2 };
+
+    /// Open this thread's counters; false if the first one (cycles,
+    /// or task-clock) is unavailable.
+    bool open(kind k) {
+#if defined(__linux__)
+      close();
+      for (int i = 0; i < NumPerfCounters; i++) {
+	_fds[i] = -1;
+	_pages[i] = nullptr;
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type(k, i);
+	attr.config = config(k, i);
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	int fd = (int) syscall(SYS_perf_event_open, &attr, 0, -1, (i == 0) ? -1 : _fds[0], 0);
+	if (fd < 0) {
+	  if (i == 0) {
+	    return false;
+	  }
+	  continue;
+	}
+	_fds[i] = fd;
+	if (k == Hardware) {
+	  auto * page = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+	  if (page != MAP_FAILED) {
+	    _pages[i] = (struct perf_event_mmap_page *) page;
+	  }
+	}
+      }
+      _open = true;
+      return true;
+#else
+      (void) k;
+      return false;
+#endif
+    }
+
+    void close() {
+#if defined(__linux__)
+      if (!_open) {
+	return;
+      }
+      for (int i = 0; i < NumPerfCounters; i++) {
+	if (_pages[i]) {
+	  munmap(_pages[i], sysconf(_SC_PAGESIZE));
+	}
+	if (_fds[i] >= 0) {
+	  ::close(_fds[i]);
+	}
+      }
+      _open = false;
+#endif
+    }
+
+    inline bool isOpen() const {
+      return _open;
+    }
+
+    /// The current value of every counter.
+    inline void read(uint64_t values[NumPerfCounters]) const {
+      for (int i = 0; i < NumPerfCounters; i++) {
+	values[i] = 0;
+      }
+#if defined(__linux__)
+      if (!_open || readPmcs(values)) {
+	return;
+      }
+      // The group's values, in the order its members were added.
+      uint64_t group[3 + NumPerfCounters];
+      auto got = ::read(_fds[0], group, sizeof(group));
+      if (got < (ssize_t) (3 * sizeof(uint64_t))) {
+	return;
+      }
+      auto enabled = group[1];
+      auto running = group[2];
+      if (running == 0) {
+	return;
+      }
+      uint64_t n = 0;
+      for (int i = 0; (i < NumPerfCounters) && (n < group[0]); i++) {
+	if (_fds[i] < 0) {
+	  continue;
+	}
+	auto value = group[3 + n++];
+	if (running < enabled) {
+	  value = (uint64_t) ((double) value * enabled / running);
+	}
+	values[i] = value;
+      }
+#endif
+    }
+
+    static const char * name(kind k, int i) {
+      static const char * names[][NumPerfCounters] = {
+	{ "-", "-", "-", "-", "-" },
+	{ "cycles", "instructions", "l1d_misses", "llc_misses", "dtlb_misses" },
+	{ "task_clock_ns", "page_faults", "minor_faults", "major_faults", "context_switches" },
+      };
+      return names[k][i];
+    }
+
+  private:
+
+#if defined(__linux__)
+    static uint32_t type(kind k, int i) {
+      if (k == Software) {
+	return PERF_TYPE_SOFTWARE;
+      }
+      return ((i == 2) || (i == 4)) ? PERF_TYPE_HW_CACHE : PERF_TYPE_HARDWARE;
+    }
+
+    static uint64_t config(kind k, int i) {
+      enum { ReadMiss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) };
+      static const uint64_t hardware[] = {
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_L1D | ReadMiss,
+	PERF_COUNT_HW_CACHE_MISSES,
+	PERF_COUNT_HW_CACHE_DTLB | ReadMiss,
+      };
+      static const uint64_t software[] = {
+	PERF_COUNT_SW_TASK_CLOCK,
+	PERF_COUNT_SW_PAGE_FAULTS,
+	PERF_COUNT_SW_PAGE_FAULTS_MIN,
+	PERF_COUNT_SW_PAGE_FAULTS_MAJ,
+	PERF_COUNT_SW_CONTEXT_SWITCHES,
+      };
+      return (k == Software) ? software[i] : hardware[i];
+    }
+#endif
+
+    /// Read every counter with rdpmc; false unless each one is on the
+    /// PMU and the group has been since it was opened, so the counts
+    /// need no scaling.
+    inline bool readPmcs(uint64_t values[NumPerfCounters]) const {
+#if defined(__linux__) && (defined(__x86_64__) || defined(__i386__))
+      for (int i = 0; i < NumPerfCounters; i++) {
+	if (_fds[i] < 0) {
+	  continue;
+	}
+	auto * pc = _pages[i];
+	if (!pc) {
+	  return false;
+	}
+	// The self-monitoring protocol in linux/perf_event.h: retry if
+	// the kernel updated the page while we read it.
+	uint32_t seq;
+	uint64_t count;
+	bool scheduled;
+	do {
+	  seq = pc->lock;
+	  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+	  auto index = pc->index;
+	  scheduled = pc->cap_user_rdpmc && index && (pc->time_enabled == pc->time_running);
+	  count = pc->offset;
+	  if (scheduled) {
+	    auto width = pc->pmc_width;
+	    int64_t pmc = (int64_t) __rdpmc(index - 1);
+	    pmc <<= 64 - width;
+	    pmc >>= 64 - width;
+	    count += pmc;
+	  }
+	  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+	} while (pc->lock != seq);
+	if (!scheduled) {
+	  return false;
+	}
+	values[i] = count;
+      }
+      return true;
+#else
+      (void) values;
+      return false;
+#endif
+    }
+
+    bool _open;
+    int _fds[NumPerfCounters];
+#if defined(__linux__)
+    struct perf_event_mmap_page * _pages[NumPerfCounters];
+#endif
+  };
+
+}
+
+#endif
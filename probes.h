@@ -0,0 +1,86 @@
+/* -*- C++ -*- */
+
+#pragma once
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#include <stdint.h>
+
+#include "common.hpp"
+
+/**
+ * USDT (SystemTap-style) static probes in the "cheap" provider.
+ *
+ * Each probe is a nop, plus a .note.stapsdt entry naming it and saying
+ * where its arguments are (the format of <sys/sdt.h>, which we do not
+ * need installed). Nothing runs until a tracer attaches:
+ *
+ *   bpftrace -e 'usdt:./libcheap.so:cheap:refill { @[arg1] = count(); }'
+ *   perf probe -x ./libcheap.so sdt_cheap:scope_begin
+ *
+ * Arguments are passed as 64-bit unsigned values. Probes compile to
+ * nothing without USE_PROBES, or off Linux on x86-64 and AArch64.
+ */
+
+#if USE_PROBES && defined(__linux__) && defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__))
+
+#if defined(__x86_64__)
+#define CHEAP_PROBE_CONSTRAINT "nor"
+#else
+#define CHEAP_PROBE_CONSTRAINT "r"
+#endif
+
+#define CHEAP_PROBE_ARG(n, x) [_cheap_a##n] CHEAP_PROBE_CONSTRAINT ((uint64_t) (uintptr_t) (x))
+
+// The nop, its note, and (once per object) the .stapsdt.base symbol
+// that tracers use to relocate the probe address.
+#define CHEAP_PROBE_ASM(name, args)					\
+  __asm__ __volatile__ ("990: nop\n"					\
+			".pushsection .note.stapsdt,\"?\",\"note\"\n"	\
+			".balign 4\n"					\
+			".4byte 992f-991f, 994f-993f, 3\n"		\
+			"991: .asciz \"stapsdt\"\n"			\
+			"992: .balign 4\n"				\
+			"993: .8byte 990b\n"				\
+			".8byte _.stapsdt.base\n"			\
+			".8byte 0\n"					\
+			".asciz \"cheap\"\n"				\
+			".asciz \"" #name "\"\n"			\
+			".asciz \"" args "\"\n"				\
+			"994: .balign 4\n"				\
+			".popsection\n"					\
+			".ifndef _.stapsdt.base\n"			\
+			".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+			".weak _.stapsdt.base\n"			\
+			".hidden _.stapsdt.base\n"			\
+			"_.stapsdt.base: .space 1\n"			\
+			".size _.stapsdt.base, 1\n"			\
+			".popsection\n"					\
+			".endif\n"
+
+#define CHEAP_PROBE0(name)			\
+  CHEAP_PROBE_ASM(name, "") :: )
+
+#define CHEAP_PROBE1(name, a1)					\
+  CHEAP_PROBE_ASM(name, "8@%[_cheap_a1]")			\
+		  :: CHEAP_PROBE_ARG(1, a1))
+
+#define CHEAP_PROBE2(name, a1, a2)					\
+  CHEAP_PROBE_ASM(name, "8@%[_cheap_a1] 8@%[_cheap_a2]")		\
+		  :: CHEAP_PROBE_ARG(1, a1), CHEAP_PROBE_ARG(2, a2))
+
+#define CHEAP_PROBE3(name, a1, a2, a3)					\
+  CHEAP_PROBE_ASM(name, "8@%[_cheap_a1] 8@%[_cheap_a2] 8@%[_cheap_a3]") \
+		  :: CHEAP_PROBE_ARG(1, a1), CHEAP_PROBE_ARG(2, a2), CHEAP_PROBE_ARG(3, a3))
+
+#else
+
+#define CHEAP_PROBE0(name)
+#define CHEAP_PROBE1(name, a1)
+#define CHEAP_PROBE2(name, a1, a2)
+#define CHEAP_PROBE3(name, a1, a2, a3)
+
+#endif
+
+#endif
@@ -7,7 +7,79 @@
 
 #include "heaplayers.h"
 
+#include "common.hpp"
+
 #include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace cheap {
+
+  /// How a RegionHeap sizes, backs and keeps its chunks (see
+  /// fromEnvironment() for the CHEAP_* variables that set them).
+  class region_geometry {
+  public:
+
+    enum huge_pages { DefaultPages = 0, HugePages = 1, NoHugePages = 2 };
+    enum : size_t { Unlimited = ~(size_t) 0 };
+
+    size_t initialChunkSize;
+    /// Each chunk is this much larger than the last (at least 1).
+    float growth;
+    /// No chunk grows beyond this (but one request may need more).
+    size_t maxChunkSize {Unlimited};
+    huge_pages hugePages {DefaultPages};
+    /// How many bytes of chunks stay resident, for reuse, once a region
+    /// is cleared; the pages of the rest are returned to the OS. With
+    /// Unlimited, every chunk goes back to the heap below, as is.
+    size_t retainBytes {Unlimited};
+
+    /// defaults, overridden by CHEAP_CHUNK_SIZE, CHEAP_CHUNK_GROWTH,
+    /// CHEAP_MAX_CHUNK_SIZE, CHEAP_HUGE_PAGES ("always" or "never")
+    /// and CHEAP_RETAIN. Sizes take a k, m or g suffix.
+    static region_geometry fromEnvironment(const region_geometry& defaults) {
+      auto g = defaults;
+      auto * v = getenv("CHEAP_CHUNK_SIZE");
+      if (v && *v && (parseSize(v) > 0)) {
+	g.initialChunkSize = parseSize(v);
+      }
+      v = getenv("CHEAP_CHUNK_GROWTH");
+      if (v && *v && (strtod(v, nullptr) >= 1.0)) {
+	g.growth = (float) strtod(v, nullptr);
+      }
+      v = getenv("CHEAP_MAX_CHUNK_SIZE");
+      if (v && *v && (parseSize(v) > 0)) {
+	g.maxChunkSize = parseSize(v);
+      }
+      v = getenv("CHEAP_HUGE_PAGES");
+      if (v && ((strcmp(v, "always") == 0) || (strcmp(v, "1") == 0))) {
+	g.hugePages = HugePages;
+      } else if (v && ((strcmp(v, "never") == 0) || (strcmp(v, "0") == 0))) {
+	g.hugePages = NoHugePages;
+      }
+      v = getenv("CHEAP_RETAIN");
+      if (v && *v) {
+	g.retainBytes = parseSize(v);
+      }
+      return g;
+    }
+
+    static size_t parseSize(const char * s) {
+      char * end;
+      auto n = (size_t) strtoull(s, &end, 10);
+      switch (*end) {
+      case 'g': case 'G': return n << 30;
+      case 'm': case 'M': return n << 20;
+      case 'k': case 'K': return n << 10;
+      default: return n;
+      }
+    }
+  };
+
+}
 
 template <class SuperHeap,
 	  unsigned int MultiplierNumerator = 2,
@@ -18,11 +90,23 @@ public:
 
   //  enum { Alignment = SuperHeap::Alignment };
 
-  RegionHeap()
+  RegionHeap(size_t initialChunkSize = ChunkSize)
+    : RegionHeap(initialChunkSize, defaultGeometry())
+  {}
+
+  /// A region with the given geometry, but starting with chunks of
+  /// initialChunkSize bytes.
+  RegionHeap(size_t initialChunkSize, const cheap::region_geometry& g)
     : _sizeRemaining (0),
       _currentArena (nullptr),
+      _currentPointer (nullptr),
       _pastArenas (nullptr),
-      _lastChunkSize (ChunkSize)
+      _lastChunkSize (initialChunkSize),
+      _initialChunkSize (initialChunkSize),
+      _growth (g.growth),
+      _maxChunkSize (g.maxChunkSize),
+      _hugePages (g.hugePages),
+      _retainBytes (g.retainBytes)
   {
     static_assert(MultiplierNumerator >= MultiplierDenominator,
 		  "Numerator must be at least as large as the denominator.");
@@ -33,6 +117,16 @@ public:
   ~RegionHeap()
   {
     clear();
+    while (_retained != nullptr) {
+      auto * a = _retained;
+      _retained = a->nextArena;
+      SuperHeap::free ((void *) a);
+    }
+  }
+
+  /// The template's geometry, with no limits.
+  static cheap::region_geometry defaultGeometry() {
+    return cheap::region_geometry { ChunkSize, (float) MultiplierNumerator / MultiplierDenominator };
   }
 
   inline void * __attribute__((always_inline)) malloc (size_t sz) {
@@ -53,6 +147,65 @@ public:
     return ptr;
   }
 
+  /// How many chunks this region has obtained.
+  inline uint64_t refills() const {
+    return _refills;
+  }
+
+  /// The total size of those chunks.
+  inline uint64_t refilledBytes() const {
+    return _refilledBytes;
+  }
+
+  static constexpr size_t defaultChunkSize() {
+    return ChunkSize;
+  }
+
+  /// True if ptr, just returned by malloc, lies in memory this region
+  /// has not handed out since it was mapped, and so is still zero.
+  /// This assumes SuperHeap returns zeroed memory for chunks we have
+  /// not freed to it before, as mmap-backed heaps do.
+  inline bool untouched(const void * ptr) const {
+    return ((const char *) ptr >= _virgin) && ((const char *) ptr < _currentPointer);
+  }
+
+  class Mark;
+
+  /// Remember the current allocation position.
+  inline Mark mark() const {
+    return Mark { _currentArena, _currentPointer, _sizeRemaining, _lastChunkSize };
+  }
+
+  /// Release everything allocated since the given mark was taken.
+  void __attribute__((noinline)) rewind(const Mark& m) {
+    if (_currentArena != nullptr) {
+      retire(_currentArena);
+    }
+    while (_currentArena != m.arena) {
+      if ((_currentArena == nullptr) && (_pastArenas == nullptr)) {
+	// Not a mark from this region (or it was already released).
+	clear();
+	return;
+      }
+      if (_currentArena != nullptr) {
+	release(_currentArena);
+      }
+      _currentArena = _pastArenas;
+      if (_pastArenas != nullptr) {
+	_pastArenas = _pastArenas->nextArena;
+      }
+    }
+    if (_currentArena != nullptr) {
+      // What we rewind over has been used.
+      _virgin = (char *) _currentArena + _currentArena->used;
+      _currentPointer = m.pointer;
+      _sizeRemaining = m.remaining;
+    } else {
+      _sizeRemaining = 0;
+    }
+    _lastChunkSize = m.lastChunkSize;
+  }
+
   /// Free in a zone allocator is a no-op.
   void __attribute__((always_inline)) free (void *) {}
   
@@ -60,17 +213,20 @@ public:
   {
     Arena * ptr = _pastArenas;
     while (ptr != nullptr) {
-      void * oldPtr = (void *) ptr;
+      auto * old = ptr;
       ptr = ptr->nextArena;
-      SuperHeap::free (oldPtr);
+      release(old);
     }
     if (_currentArena != nullptr) {
-      SuperHeap::free ((void *) _currentArena);
+      retire(_currentArena);
+      release(_currentArena);
     }
     _sizeRemaining = 0;
     _currentArena = nullptr;
+    _currentPointer = nullptr;
+    _virgin = nullptr;
     _pastArenas = nullptr;
-    _lastChunkSize = ChunkSize;
+    _lastChunkSize = _initialChunkSize;
   }
 
 private:
@@ -79,35 +235,139 @@ private:
   
   RegionHeap (const RegionHeap&);
   RegionHeap& operator=(const RegionHeap&);
+
+  class Arena;
   
   void __attribute__((noinline)) refill(size_t sz) {
     // Get more space in our arena since there's not enough room in this one.
     // First, add this arena to our past arena list.
     if (_currentArena) {
+      retire(_currentArena);
       _currentArena->nextArena = _pastArenas;
       _pastArenas = _currentArena;
     }
     // Now get more memory.
-    size_t allocSize = (int) _lastChunkSize;
-    _lastChunkSize *= MultiplierNumerator;
-    _lastChunkSize /= MultiplierDenominator;
-    if (allocSize < sz) {
+    _refills++;
+    size_t allocSize = (size_t) _lastChunkSize;
+    _lastChunkSize *= _growth;
+    if (_lastChunkSize > _maxChunkSize) {
+      _lastChunkSize = _maxChunkSize;
+    }
+    if (allocSize < sz + sizeof(Arena)) {
       allocSize += sz;
     }
-    _currentArena =
-      (Arena *) SuperHeap::malloc(allocSize);
+    // Reuse the smallest retained chunk that is large enough.
+    Arena ** best = nullptr;
+    for (Arena ** p = &_retained; *p != nullptr; p = &(*p)->nextArena) {
+      if (((*p)->size >= allocSize) && (!best || ((*p)->size < (*best)->size))) {
+	best = p;
+      }
+    }
+    _currentArena = nullptr;
+    size_t used = sizeof(Arena);
+    if (best) {
+      _currentArena = *best;
+      *best = _currentArena->nextArena;
+      _retainedBytes -= _currentArena->size;
+      allocSize = _currentArena->size;
+      used = _currentArena->used;
+    }
+    if (!_currentArena) {
+      _refilledBytes += allocSize;
+      _currentArena =
+	(Arena *) SuperHeap::malloc(allocSize);
+      if (_currentArena && (_hugePages != cheap::region_geometry::DefaultPages)) {
+	advise(_currentArena, allocSize,
+	       (_hugePages == cheap::region_geometry::HugePages) ? Huge : NotHuge);
+      }
+      if (_currentArena) {
+	used = recycled(_currentArena, allocSize);
+      }
+    }
     if (_currentArena) {
       assert(_currentArena != nullptr);
       // _currentArena->arenaSpace = (char *) (_currentArena + 1);
       _currentPointer = (char *) (_currentArena + 1);
       _currentArena->nextArena = nullptr;
+      _currentArena->size = allocSize;
+      _currentArena->used = used;
+      _virgin = (char *) _currentArena + used;
       _sizeRemaining = allocSize - sizeof(Arena);
     } else {
+      _currentPointer = nullptr;
+      _virgin = nullptr;
       _sizeRemaining = 0;
     }
   }
+
+  /// Record how far into the current chunk a has ever been used.
+  inline void retire(Arena * a) {
+    auto top = (_currentPointer > _virgin) ? _currentPointer : _virgin;
+    a->used = top - (char *) a;
+  }
+
+  /// How much of a chunk just obtained from SuperHeap has been used:
+  /// none, unless we freed it to SuperHeap before (or lost track).
+  size_t recycled(Arena * a, size_t size) {
+    for (int i = 0; i < _numReleased; i++) {
+      if (_released[i].chunk == a) {
+	auto used = _released[i].used;
+	_released[i] = _released[--_numReleased];
+	return (used < size) ? used : size;
+      }
+    }
+    return _releasedOverflow ? size : sizeof(Arena);
+  }
+
+  /// Free a chunk to SuperHeap, remembering how much of it was used.
+  void freeChunk(Arena * a) {
+    if (_numReleased < MaxReleased) {
+      _released[_numReleased++] = Released { a, a->used };
+    } else {
+      _releasedOverflow = true;
+    }
+    SuperHeap::free ((void *) a);
+  }
+
+  /// Give back a chunk we are done with: keep it for reuse while under
+  /// the retention limit, else free it (returning its pages to the OS
+  /// first, if there is a limit).
+  void release(Arena * a) {
+    if (_retainBytes == cheap::region_geometry::Unlimited) {
+      freeChunk(a);
+      return;
+    }
+    if (_retainedBytes + a->size <= _retainBytes) {
+      a->nextArena = _retained;
+      _retained = a;
+      _retainedBytes += a->size;
+      return;
+    }
+    advise(a, a->size, Discard);
+    freeChunk(a);
+  }
+
+  enum advice { Huge, NotHuge, Discard };
+
+  /// madvise the whole pages of the chunk after its header.
+  static void advise(Arena * a, size_t size, advice how) {
+    auto page = (uintptr_t) sysconf(_SC_PAGESIZE);
+    auto start = ((uintptr_t) (a + 1) + page - 1) & ~(page - 1);
+    auto end = ((uintptr_t) a + size) & ~(page - 1);
+    if (end <= start) {
+      return;
+    }
+    switch (how) {
+#if defined(MADV_HUGEPAGE)
+    case Huge: madvise((void *) start, end - start, MADV_HUGEPAGE); break;
+    case NotHuge: madvise((void *) start, end - start, MADV_NOHUGEPAGE); break;
+#endif
+    case Discard: madvise((void *) start, end - start, MADV_DONTNEED); break;
+    default: break;
+    }
+  }
   
-  class Arena {
+  class alignas(HL::MallocInfo::Alignment) Arena {
   public:
     Arena() {
       static_assert((sizeof(Arena) % HL::MallocInfo::Alignment == 0),
@@ -116,7 +376,32 @@ private:
     
     //    alignas(8) char * arenaSpace;
     Arena * nextArena { nullptr };
+    size_t size { 0 };
+    /// Bytes from the start of the chunk that have ever been handed
+    /// out (recorded when the chunk stops being the current one).
+    size_t used { 0 };
+  };
+
+  /// Chunks freed to SuperHeap, and how much of each had been used.
+  enum { MaxReleased = 8 };
+  class Released {
+  public:
+    Arena * chunk;
+    size_t used;
+  };
+
+public:
+
+  /// A saved allocation position (see mark() and rewind()).
+  class Mark {
+  public:
+    Arena * arena;
+    char * pointer;
+    size_t remaining;
+    float lastChunkSize;
   };
+
+private:
     
   /// Space left in the current arena.
   size_t _sizeRemaining;
@@ -132,6 +417,31 @@ private:
 
   /// Last size (which increases geometrically).
   float _lastChunkSize;
+
+  /// The size of the first chunk, restored by clear().
+  size_t _initialChunkSize;
+
+  /// Geometry (see cheap::region_geometry).
+  float _growth;
+  size_t _maxChunkSize;
+  cheap::region_geometry::huge_pages _hugePages;
+  size_t _retainBytes;
+
+  /// The current chunk is untouched from here on (see untouched()).
+  char * _virgin {nullptr};
+
+  Released _released[MaxReleased];
+  int _numReleased {0};
+  bool _releasedOverflow {false};
+
+  /// Chunks kept after clear() or rewind() for reuse, and their size.
+  Arena * _retained {nullptr};
+  size_t _retainedBytes {0};
+
+  /// Calls to refill(), and the size of the new chunks they obtained
+  /// (not counting reused ones).
+  uint64_t _refills {0};
+  uint64_t _refilledBytes {0};
 };
 
 #endif
@@ -0,0 +1,183 @@
+/* -*- C++ -*- */
+
+#pragma once
+
+#ifndef SCOPECONFIG_H
+#define SCOPECONFIG_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dlfcn.h>
+
+namespace cheap {
+
+  /**
+   * Scopes applied at run time rather than in the source: a list of
+   * functions (or code ranges), each with scope flags and a size hint.
+   * libcheap reads it from CHEAP_SCOPES (the text itself) or
+   * CHEAP_CONFIG (a file), one entry per line or ';'-separated:
+   *
+   *   # target          flags                       size
+   *   parse_document    DISABLE_FREE                0
+   *   0x4011a0-0x4013f0 SAME_SIZE|SIZE_TAKEN        64
+   *
+   * Targets are dynamic symbols (link with -rdynamic) or address
+   * ranges; flags are cheap::flags names (with or without CHEAP_) or
+   * numbers. Entries that cannot be resolved are skipped.
+   */
+  class scope_config {
+  public:
+
+    enum { MaxEntries = 64 };
+
+    class entry {
+    public:
+      uintptr_t lo;
+      uintptr_t hi;  // inclusive
+      int flags;
+      size_t size;
+    };
+
+    constexpr scope_config() {}
+
+    /// Add the entries in text (which is modified). Returns the number
+    /// of entries added.
+    int parse(char * text) {
+      int added = 0;
+      char * line = text;
+      while (line && *line) {
+	auto * end = line + strcspn(line, "\n;");
+	auto next = *end ? end + 1 : nullptr;
+	*end = '\0';
+	if (auto * hash = strchr(line, '#')) {
+	  *hash = '\0';
+	}
+	if (parseLine(line)) {
+	  added++;
+	}
+	line = next;
+      }
+      return added;
+    }
+
+    /// The entry for the function starting at (or containing) fn, or nullptr.
+    inline const entry * find(const void * fn) const {
+      auto pc = (uintptr_t) fn;
+      if (likely((pc < _lo) || (pc > _hi))) {
+	return nullptr;
+      }
+      for (int i = 0; i < _count; i++) {
+	if ((pc >= _entries[i].lo) && (pc <= _entries[i].hi)) {
+	  return &_entries[i];
+	}
+      }
+      return nullptr;
+    }
+
+    inline bool empty() const {
+      return _count == 0;
+    }
+
+  private:
+
+    static char * token(char *& p) {
+      while (*p == ' ' || *p == '\t' || *p == '\r') {
+	p++;
+      }
+      if (!*p) {
+	return nullptr;
+      }
+      auto * start = p;
+      while (*p && *p != ' ' && *p != '\t' && *p != '\r') {
+	p++;
+      }
+      if (*p) {
+	*p++ = '\0';
+      }
+      return start;
+    }
+
+    static bool parseFlags(char * text, int& flags) {
+      static const struct { const char * name; int value; } names[] = {
+	{ "ALIGNED", CHEAP_ALIGNED },
+	{ "NONZERO", CHEAP_NONZERO },
+	{ "SIZE_TAKEN", CHEAP_SIZE_TAKEN },
+	{ "SINGLE_THREADED", CHEAP_SINGLE_THREADED },
+	{ "DISABLE_FREE", CHEAP_DISABLE_FREE },
+	{ "SAME_SIZE", CHEAP_SAME_SIZE },
+	{ "FIXED_BUFFER", CHEAP_FIXED_BUFFER },
+	{ "INHERIT_THREADS", CHEAP_INHERIT_THREADS },
+      };
+      flags = 0;
+      char * name = text;
+      while (name && *name) {
+	auto * bar = strchr(name, '|');
+	if (bar) {
+	  *bar = '\0';
+	}
+	if (strncmp(name, "CHEAP_", 6) == 0) {
+	  name += 6;
+	}
+	bool found = false;
+	if ((*name >= '0') && (*name <= '9')) {
+	  flags |= (int) strtol(name, nullptr, 0);
+	  found = true;
+	}
+	for (auto& n : names) {
+	  if (strcmp(name, n.name) == 0) {
+	    flags |= n.value;
+	    found = true;
+	  }
+	}
+	if (!found) {
+	  return false;
+	}
+	name = bar ? bar + 1 : nullptr;
+      }
+      return true;
+    }
+
+    bool parseLine(char * line) {
+      auto * target = token(line);
+      auto * flagText = token(line);
+      auto * sizeText = token(line);
+      if (!target || !flagText || (_count == MaxEntries)) {
+	return false;
+      }
+      entry e;
+      if (!parseFlags(flagText, e.flags)) {
+	return false;
+      }
+      e.size = sizeText ? (size_t) strtoull(sizeText, nullptr, 0) : 0;
+      if ((target[0] == '0') && (target[1] == 'x')) {
+	char * dash;
+	e.lo = (uintptr_t) strtoull(target, &dash, 16);
+	e.hi = (*dash == '-') ? (uintptr_t) strtoull(dash + 1, nullptr, 16) - 1 : e.lo;
+      } else {
+	auto * fn = dlsym(RTLD_DEFAULT, target);
+	if (!fn) {
+	  return false;
+	}
+	e.lo = e.hi = (uintptr_t) fn;
+      }
+      _entries[_count++] = e;
+      if ((_count == 1) || (e.lo < _lo)) {
+	_lo = e.lo;
+      }
+      if ((_count == 1) || (e.hi > _hi)) {
+	_hi = e.hi;
+      }
+      return true;
+    }
+
+    entry _entries[MaxEntries] {};
+    int _count {0};
+    uintptr_t _lo {0};
+    uintptr_t _hi {0};
+  };
+
+}
+
+#endif
@@ -0,0 +1,338 @@
+/* -*- C++ -*- */
+
+#pragma once
+
+#ifndef SCOPESTATS_H
+#define SCOPESTATS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "common.hpp"
+
+namespace cheap {
+
+  /// A cheap timestamp: the TSC on x86, nanoseconds elsewhere.
+  inline uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+  }
+
+  /// A log-linear histogram (SubBuckets buckets per power of two) with
+  /// relaxed atomic counts, so threads can add to a shared one.
+  class histogram {
+  public:
+
+    enum { SubBits = 2 };
+    enum { SubBuckets = 1 << SubBits };
+    enum { NumBuckets = 64 * SubBuckets };
+
+    constexpr histogram() {}
+
+    inline void add(uint64_t value) {
+      _counts[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+      _count.fetch_add(1, std::memory_order_relaxed);
+      _sum.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    /// add(), for a histogram that only one thread adds to: no atomic
+    /// read-modify-writes, though other threads may still read it.
+    inline void addLocal(uint64_t value) {
+      bump(_counts[bucket(value)], 1);
+      bump(_count, 1);
+      bump(_sum, value);
+    }
+
+    void merge(const histogram& other) {
+      for (int i = 0; i < NumBuckets; i++) {
+	_counts[i].fetch_add(other._counts[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+      }
+      _count.fetch_add(other.count(), std::memory_order_relaxed);
+      _sum.fetch_add(other.sum(), std::memory_order_relaxed);
+    }
+
+    uint64_t count() const {
+      return _count.load(std::memory_order_relaxed);
+    }
+
+    uint64_t sum() const {
+      return _sum.load(std::memory_order_relaxed);
+    }
+
+    double mean() const {
+      auto n = count();
+      return n ? (double) sum() / n : 0;
+    }
+
+    /// The lower bound of the bucket holding the p-th percentile (0-100).
+    uint64_t percentile(double p) const {
+      auto n = count();
+      if (n == 0) {
+	return 0;
+      }
+      auto rank = (uint64_t) (p / 100.0 * (n - 1));
+      uint64_t seen = 0;
+      for (int i = 0; i < NumBuckets; i++) {
+	seen += _counts[i].load(std::memory_order_relaxed);
+	if (seen > rank) {
+	  return lowerBound(i);
+	}
+      }
+      return lowerBound(NumBuckets - 1);
+    }
+
+    static inline int bucket(uint64_t value) {
+      if (value < SubBuckets) {
+	return (int) value;
+      }
+      int lg = 63 - __builtin_clzll(value);
+      int sub = (int) (value >> (lg - SubBits)) & (SubBuckets - 1);
+      return ((lg - SubBits + 1) << SubBits) + sub;
+    }
+
+    static inline uint64_t lowerBound(int b) {
+      if (b < SubBuckets) {
+	return b;
+      }
+      int lg = (b >> SubBits) + SubBits - 1;
+      return (uint64_t) (SubBuckets + (b & (SubBuckets - 1))) << (lg - SubBits);
+    }
+
+  private:
+    static inline void bump(std::atomic<uint64_t>& a, uint64_t n) {
+      a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> _counts[NumBuckets] {};
+    std::atomic<uint64_t> _count {0};
+    std::atomic<uint64_t> _sum {0};
+  };
+
+  /// Sampled latencies of xxmalloc and xxfree, split by the path they
+  /// took (see CHEAP_LATENCY in README.md). Each thread fills its own.
+  class latency_table {
+  public:
+
+    enum { Malloc = 0, Free = 1, NumOps = 2 };
+
+    /// For frees: RegionBump = an ignored region free, FreelistHit = a
+    /// push onto a scope's freelist, Fallback = the heap.
+    enum { RegionBump = 0, RegionRefill, FreelistHit, FreelistMiss, Fallback, NumPaths };
+
+    void merge(const latency_table& other) {
+      for (int op = 0; op < NumOps; op++) {
+	for (int path = 0; path < NumPaths; path++) {
+	  cycles[op][path].merge(other.cycles[op][path]);
+	}
+      }
+    }
+
+    histogram cycles[NumOps][NumPaths];
+    latency_table * next {nullptr};
+  };
+
+  /// Counters read at scope entry and exit (see perfcounters.h).
+  enum { NumPerfCounters = 5 };
+
+  class cheap_base;
+  class scope_site;
+
+  /// What is tracked about one live scope instance (cheap_base::instance):
+  /// for every scope with USE_SCOPE_STATS, and otherwise only for those
+  /// libcheap measures. site is null unless libcheap is measuring it.
+  class scope_instance {
+  public:
+    scope_site * site {nullptr};
+    uint64_t start {0};
+    uint64_t allocations {0};
+    uint64_t bytes {0};
+    uint64_t refillsAtOpen {0};
+    uint64_t ignoredFrees {0};
+    uint64_t spills {0};
+    uint64_t counters[NumPerfCounters] {};
+    uint64_t traceStart {0};
+    /// At entry, with CHEAP_RSS (see README.md).
+    uint64_t refilledBytesAtOpen {0};
+    uint64_t minorFaults {0};
+    uint64_t majorFaults {0};
+    uint64_t rss {0};
+    bool bypassed {false};
+    /// While bypassed (CHEAP_AB), the stand-in that is current().
+    cheap_base * passThrough {nullptr};
+  };
+
+  /// Totals for every instance of one scope, identified by its source
+  /// location (C++ scopes) or the code address that opened it.
+  class scope_site {
+  public:
+
+    /// A/B arms (see CHEAP_AB in README.md).
+    enum { Scoped = 0, Bypassed = 1, NumArms = 2 };
+
+    class arm {
+    public:
+      std::atomic<uint64_t> instances {0};
+      std::atomic<uint64_t> allocations {0};
+      std::atomic<uint64_t> refills {0};
+      std::atomic<uint64_t> ignoredFrees {0};
+      std::atomic<uint64_t> spills {0};
+      std::atomic<uint64_t> counters[NumPerfCounters] {};
+      /// With CHEAP_RSS: fault and region chunk totals, the sum of the
+      /// resident set's growth over each instance, and the largest
+      /// estimated peak of one (see CHEAP_RSS in README.md).
+      std::atomic<uint64_t> minorFaults {0};
+      std::atomic<uint64_t> majorFaults {0};
+      std::atomic<uint64_t> mappedBytes {0};
+      std::atomic<int64_t> rssGrowth {0};
+      std::atomic<uint64_t> rssPeak {0};
+      histogram cycles;
+      histogram bytes;
+    };
+
+    const char * file {nullptr};
+    int line {0};
+    uintptr_t pc {0};
+    arm arms[NumArms];
+    /// Set once the site has been named in the live stats page.
+    std::atomic<bool> published {false};
+
+    bool matches(const char * f, int l, uintptr_t p) const {
+      if (f) {
+	return file && (line == l) && ((file == f) || (strcmp(file, f) == 0));
+      }
+      return !file && (pc == p);
+    }
+  };
+
+  /// A fixed table of scope sites, filled as scopes are first seen.
+  class scope_sites {
+  public:
+
+    enum { MaxSites = 128 };
+
+    constexpr scope_sites() {}
+
+    /// The site for a scope at file:line (or, if file is null, opened
+    /// from pc); nullptr if the table is full.
+    scope_site * find(const char * file, int line, uintptr_t pc) {
+      _lock.lock();
+      for (int i = 0; i < _count; i++) {
+	if (_sites[i].matches(file, line, pc)) {
+	  _lock.unlock();
+	  return &_sites[i];
+	}
+      }
+      scope_site * s = nullptr;
+      if (_count < MaxSites) {
+	s = &_sites[_count];
+	s->file = file;
+	s->line = line;
+	s->pc = pc;
+	_count++;
+      }
+      _lock.unlock();
+      return s;
+    }
+
+    int count() const {
+      return _count;
+    }
+
+    scope_site& operator[](int i) {
+      return _sites[i];
+    }
+
+    int indexOf(const scope_site * s) const {
+      return (int) (s - _sites);
+    }
+
+  private:
+    spin_lock _lock;
+    int _count {0};
+    scope_site _sites[MaxSites];
+  };
+
+  /// Sampled allocating call stacks and where their requests were
+  /// served (see CHEAP_VERIFY in README.md): an open-addressed table,
+  /// keyed by a hash of the innermost Depth return addresses outside
+  /// libcheap. Once full, new stacks are counted as dropped.
+  class stack_table {
+  public:
+
+    enum { Depth = 4 };
+    enum { MaxStacks = 4096 }; // a power of two
+
+    class entry {
+    public:
+      std::atomic<uint64_t> key {0};
+      uintptr_t frames[Depth] {};
+      std::atomic<uint64_t> scoped {0};      // served by a scope
+      std::atomic<uint64_t> heapInScope {0}; // by the heap, with a scope open
+      std::atomic<uint64_t> heapOutside {0}; // by the heap, no scope open
+      /// The last scope site to serve one (its index + 1), or 0.
+      std::atomic<int> scope {0};
+
+      uint64_t samples() const {
+	return scoped.load(std::memory_order_relaxed)
+	  + heapInScope.load(std::memory_order_relaxed)
+	  + heapOutside.load(std::memory_order_relaxed);
+      }
+    };
+
+    constexpr stack_table() {}
+
+    /// The entry for the stack frames[0, n); nullptr if the table is full.
+    entry * find(const uintptr_t * frames, int n) {
+      uint64_t key = 0xcbf29ce484222325ULL;
+      for (int i = 0; i < n; i++) {
+	key = (key ^ frames[i]) * 0x100000001b3ULL;
+      }
+      key = key ? key : 1;
+      for (int probe = 0; probe < MaxStacks; probe++) {
+	auto& e = _entries[(key + probe) & (MaxStacks - 1)];
+	auto k = e.key.load(std::memory_order_acquire);
+	if (k == key) {
+	  return &e;
+	}
+	if ((k == 0) && e.key.compare_exchange_strong(k, key, std::memory_order_acq_rel)) {
+	  for (int i = 0; i < n; i++) {
+	    e.frames[i] = frames[i];
+	  }
+	  return &e;
+	}
+	if (k == key) {
+	  return &e;
+	}
+      }
+      _dropped.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+
+    entry& operator[](int i) {
+      return _entries[i];
+    }
+
+    uint64_t dropped() const {
+      return _dropped.load(std::memory_order_relaxed);
+    }
+
+  private:
+    entry _entries[MaxStacks];
+    std::atomic<uint64_t> _dropped {0};
+  };
+
+}
+
+#endif
@@ -0,0 +1,104 @@
+/* -*- C++ -*- */
+
+#pragma once
+
+#ifndef SITEARENAS_H
+#define SITEARENAS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.hpp"
+
+namespace cheap {
+
+  /**
+   * Per-call-site sub-arenas carved out of a region: objects from the
+   * same allocation site are bumped out of the same small chunk, so
+   * they end up next to each other instead of interleaved with
+   * everything else allocated in bump order.
+   *
+   * Sites hash into NumSets sets of Ways slots each. A site keeps its
+   * slot once it has one; a site whose set is full is served straight
+   * from the region (never evicting another site, which would strand
+   * the rest of its chunk). Objects larger than MaxObjectSize also
+   * come straight from the region. Everything is released with the
+   * region. Not thread-safe (nor are regions).
+   */
+  template <class RegionType>
+  class site_arenas {
+  public:
+
+    enum { SetBits = 4 };
+    enum { NumSets = 1 << SetBits };
+    enum { Ways = 4 };
+    enum { NumSlots = NumSets * Ways };
+    enum { ChunkSize = 16384 };
+    enum { MaxObjectSize = ChunkSize / 4 };
+
+    explicit site_arenas(RegionType * region)
+      : _region (region)
+    {}
+
+    /// Assumes sz is a multiple of MIN_ALIGNMENT.
+    inline void * malloc(uintptr_t site, size_t sz) {
+      if (unlikely(sz > MaxObjectSize)) {
+	return _region->malloc(sz);
+      }
+      auto * set = &_slots[setOf(site) * Ways];
+      for (int w = 0; w < Ways; w++) {
+	auto& s = set[w];
+	if (s.site == site) {
+	  if (likely(sz <= (size_t) (s.end - s.current))) {
+	    auto * ptr = s.current;
+	    s.current += sz;
+	    return ptr;
+	  }
+	  return refill(s, site, sz);
+	}
+      }
+      return claim(set, site, sz);
+    }
+
+    /// The set site hashes into.
+    static inline size_t setOf(uintptr_t site) {
+      return (site * 0x9E3779B97F4A7C15ULL) >> (64 - SetBits);
+    }
+
+  private:
+
+    class slot {
+    public:
+      uintptr_t site;
+      char * current;
+      char * end;
+    };
+
+    /// Give site a free slot in set, or serve it from the region.
+    void * __attribute__((noinline)) claim(slot * set, uintptr_t site, size_t sz) {
+      for (int w = 0; w < Ways; w++) {
+	if (!set[w].end) {
+	  return refill(set[w], site, sz);
+	}
+      }
+      return _region->malloc(sz);
+    }
+
+    void * __attribute__((noinline)) refill(slot& s, uintptr_t site, size_t sz) {
+      auto * chunk = (char *) _region->malloc(ChunkSize);
+      if (!chunk) {
+	return nullptr;
+      }
+      s.site = site;
+      s.current = chunk + sz;
+      s.end = chunk + ChunkSize;
+      return chunk;
+    }
+
+    RegionType * _region;
+    slot _slots[NumSlots] {};
+  };
+
+}
+
+#endif
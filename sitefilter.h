@@ -0,0 +1,173 @@
+/* -*- C++ -*- */
+
+#pragma once
+
+#ifndef SITEFILTER_H
+#define SITEFILTER_H
+
+#include <stdint.h>
+#include <unwind.h>
+
+#if defined(__linux__)
+#include <dlfcn.h>
+#include <link.h>
+#endif
+
+namespace cheap {
+
+  /**
+   * A set of code ranges (functions or whole shared objects). A scope
+   * with a filter (see cheap_base::capture_only) only captures
+   * allocations made with one of these ranges on the call stack, up to
+   * MaxDepth frames above malloc; everything else goes to the normal
+   * heap. Checking unwinds the stack on every allocation in the scope,
+   * so filters suit scopes around large, mostly self-contained code.
+   */
+  class site_filter {
+  public:
+
+    enum { MaxRanges = 16 };
+    enum { MaxDepth = 32 };
+
+    constexpr site_filter() {}
+
+    /// Capture allocations made from code in [lo, hi).
+    bool add_range(const void * lo, const void * hi) {
+      if (_count == MaxRanges) {
+	return false;
+      }
+      _ranges[_count].lo = (uintptr_t) lo;
+      _ranges[_count].hi = (uintptr_t) hi;
+      _count++;
+      return true;
+    }
+
+    /// Capture allocations made from the function containing fn, which
+    /// must have a dynamic symbol (link executables with -rdynamic).
+    bool add_function(const void * fn) {
+#if defined(__linux__)
+      Dl_info info;
+      const ElfW(Sym) * sym = nullptr;
+      if (!dladdr1(fn, &info, (void **) &sym, RTLD_DL_SYMENT) || !sym || !info.dli_saddr || !sym->st_size) {
+	return false;
+      }
+      return add_range(info.dli_saddr, (char *) info.dli_saddr + sym->st_size);
+#else
+      (void) fn;
+      return false;
+#endif
+    }
+
+    /// Capture allocations made from the executable or shared object
+    /// containing addr.
+    bool add_object(const void * addr) {
+#if defined(__linux__)
+      object_search search { this, (uintptr_t) addr, false, true };
+      dl_iterate_phdr(findObject, &search);
+      return search.found && search.ok;
+#else
+      (void) addr;
+      return false;
+#endif
+    }
+
+    inline bool contains(uintptr_t pc) const {
+      // Return addresses point just past the call.
+      for (int i = 0; i < _count; i++) {
+	if ((pc > _ranges[i].lo) && (pc <= _ranges[i].hi)) {
+	  return true;
+	}
+      }
+      return false;
+    }
+
+    /// True iff any of the caller's frames lies in this filter. The
+    /// unwinder can allocate, holding its own locks, the first time it
+    /// meets some code; such a nested request does not unwind again
+    /// (which could deadlock) but goes to the heap.
+    bool __attribute__((noinline)) matches_caller() const {
+      auto& walking = inWalk();
+      if (walking) {
+	return false;
+      }
+      walking = true;
+      walk_state state { this, 0, false };
+      _Unwind_Backtrace(step, &state);
+      walking = false;
+      return state.found;
+    }
+
+  private:
+
+    class range {
+    public:
+      uintptr_t lo;
+      uintptr_t hi;
+    };
+
+    class walk_state {
+    public:
+      const site_filter * filter;
+      int depth;
+      bool found;
+    };
+
+    /// Set while this thread unwinds for a filter.
+    static inline bool& inWalk() {
+      static __thread bool walking __attribute__((tls_model ("initial-exec")));
+      return walking;
+    }
+
+    static _Unwind_Reason_Code step(struct _Unwind_Context * context, void * arg) {
+      auto * state = (walk_state *) arg;
+      if (state->filter->contains(_Unwind_GetIP(context))) {
+	state->found = true;
+	return _URC_END_OF_STACK;
+      }
+      if (++state->depth >= MaxDepth) {
+	return _URC_END_OF_STACK;
+      }
+      return _URC_NO_REASON;
+    }
+
+#if defined(__linux__)
+    class object_search {
+    public:
+      site_filter * filter;
+      uintptr_t addr;
+      bool found;
+      bool ok;
+    };
+
+    static int findObject(struct dl_phdr_info * info, size_t, void * arg) {
+      auto * search = (object_search *) arg;
+      bool inside = false;
+      for (int i = 0; i < info->dlpi_phnum; i++) {
+	auto& ph = info->dlpi_phdr[i];
+	auto start = info->dlpi_addr + ph.p_vaddr;
+	if ((ph.p_type == PT_LOAD) && (search->addr >= start) && (search->addr < start + ph.p_memsz)) {
+	  inside = true;
+	}
+      }
+      if (!inside) {
+	return 0;
+      }
+      search->found = true;
+      for (int i = 0; i < info->dlpi_phnum; i++) {
+	auto& ph = info->dlpi_phdr[i];
+	if ((ph.p_type == PT_LOAD) && (ph.p_flags & PF_X)) {
+	  auto start = info->dlpi_addr + ph.p_vaddr;
+	  search->ok &= search->filter->add_range((void *) start, (void *) (start + ph.p_memsz));
+	}
+      }
+      return 1;
+    }
+#endif
+
+    range _ranges[MaxRanges] {};
+    int _count {0};
+  };
+
+}
+
+#endif
@@ -0,0 +1,119 @@
+/* -*- C++ -*- */
+
+#pragma once
+
+#ifndef SIZECACHE_H
+#define SIZECACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.hpp"
+
+namespace cheap {
+
+  /**
+   * A per-thread cache of recently freed small objects (see
+   * USE_SIZE_CACHES in common.hpp), one LIFO per size class, in front
+   * of whichever heap is serving the thread: the custom heap outside
+   * scopes (owner 0), or the active scope's freelist (owner =
+   * cheap_base::cache_id). Alloc/free ping-pong then never reaches the
+   * underlying heap.
+   *
+   * The cache holds objects for one owner at a time. When the owner
+   * changes, objects from the custom heap are handed back to it;
+   * objects from a scope are simply dropped, since the scope reclaims
+   * all of its memory when it ends.
+   *
+   * Must be constant-initialized (it lives in __thread storage).
+   */
+  class size_cache {
+  public:
+
+    enum { NumClasses = 16 };
+    enum { Granularity = MIN_ALIGNMENT };
+    enum { MaxSize = NumClasses * Granularity };
+    enum { Capacity = 64 }; // objects per class
+
+    /// The class all of whose objects can satisfy a request of sz bytes.
+    static inline int requestClass(size_t sz) {
+      return (sz <= Granularity) ? 0 : (int) ((sz - 1) / Granularity);
+    }
+
+    /// The largest class an object with sz usable bytes can serve, or
+    /// -1 if it is too small, or too large to be worth keeping for
+    /// requests of at most MaxSize bytes.
+    static inline int objectClass(size_t sz) {
+      if (sz > MaxSize) {
+	return -1;
+      }
+      return (int) (sz / Granularity) - 1;
+    }
+
+    /// Pop an object that can hold sz (<= MaxSize) bytes, or nullptr.
+    inline void * get(uintptr_t owner, size_t sz) {
+      if (unlikely(owner != _owner)) {
+	return nullptr;
+      }
+      auto c = requestClass(sz);
+      auto * obj = _heads[c];
+      if (likely(obj != nullptr)) {
+	_heads[c] = obj->next;
+	_counts[c]--;
+      }
+      return obj;
+    }
+
+    /// Cache an object with usable bytes of space. Returns false if the
+    /// caller should free it as usual (too small or the class is full).
+    template <class Heap>
+    inline bool put(uintptr_t owner, void * ptr, size_t usable, Heap& heap) {
+      auto c = objectClass(usable);
+      if (unlikely(c < 0)) {
+	return false;
+      }
+      if (unlikely(owner != _owner)) {
+	reset(heap);
+	_owner = owner;
+      }
+      if (unlikely(_counts[c] >= Capacity)) {
+	return false;
+      }
+      auto * obj = (object *) ptr;
+      obj->next = _heads[c];
+      _heads[c] = obj;
+      _counts[c]++;
+      return true;
+    }
+
+    /// Empty the cache, returning custom-heap objects to heap.
+    template <class Heap>
+    void reset(Heap& heap) {
+      for (int c = 0; c < NumClasses; c++) {
+	if (_owner == 0) {
+	  while (_heads[c]) {
+	    auto * obj = _heads[c];
+	    _heads[c] = obj->next;
+	    heap.free(obj);
+	  }
+	}
+	_heads[c] = nullptr;
+	_counts[c] = 0;
+      }
+    }
+
+  private:
+
+    class object {
+    public:
+      object * next;
+    };
+
+    uintptr_t _owner;
+    object * _heads[NumClasses];
+    uint16_t _counts[NumClasses];
+  };
+
+}
+
+#endif
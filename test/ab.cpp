@@ -0,0 +1,91 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cheap.h"
+#include "harness.h"
+
+// In A/B mode (CHEAP_AB=<fraction>), libcheap bypasses that fraction of
+// scope instances and reports both arms at exit.
+
+const int ROUNDS = 1000;
+const int MAXSITES = 8;
+
+int main(int, char * argv[]) {
+  using cheap_test::field;
+  if (!getenv("CHEAP_AB")) {
+    // A/B mode is chosen when libcheap loads, and the report is written
+    // when the child exits.
+    cheap_test::report_file stats;
+    cheap_test::runChild(argv, { { "CHEAP_AB", "0.5" }, { "CHEAP_STATS_FILE", stats.path() } });
+    // Per site: allocations per instance in each arm (scope, arm,
+    // instances, allocations, ... are the first columns).
+    static char sites[MAXSITES][256];
+    static double perInstance[MAXSITES][2];
+    static bool seen[MAXSITES][2];
+    int n = 0;
+    stats.forEachLine([&](const char * line) {
+      bool scoped = (strncmp(field(line, 1), "scoped\t", 7) == 0);
+      bool bypassed = (strncmp(field(line, 1), "bypassed\t", 9) == 0);
+      if (!strstr(line, "ab.cpp") || (!scoped && !bypassed)) {
+	return;
+      }
+      auto len = field(line, 1) - line;
+      int s = 0;
+      while ((s < n) && (strncmp(sites[s], line, len) != 0)) {
+	s++;
+      }
+      if (s == n) {
+	assert(n < MAXSITES);
+	strncpy(sites[n++], line, len);
+      }
+      auto instances = atof(field(line, 2));
+      assert(instances > 0);
+      perInstance[s][bypassed] = atof(field(line, 3)) / instances;
+      seen[s][bypassed] = true;
+    });
+    // The first loop's scope, and the nested loop's outer and inner.
+    assert(n == 3);
+    for (int s = 0; s < n; s++) {
+      assert(seen[s][0] && seen[s][1]);
+      // A bypassed instance is charged for its own requests, and an
+      // enclosing scope is not charged for them.
+      assert(perInstance[s][0] == perInstance[s][1]);
+    }
+    printf("ab: ok\n");
+    return 0;
+  }
+  int inScope = 0;
+  for (int i = 0; i < ROUNDS; i++) {
+    cheap::cheap<cheap::DISABLE_FREE> reg;
+    auto * p = malloc(64);
+    if (theOwnerMap().tag(p) == cheap::owner_map::Scope) {
+      inScope++;
+    }
+    free(p);
+  }
+  // Both arms are used.
+  assert((inScope > 0) && (inScope < ROUNDS));
+  // A bypassed scope's allocations are served by the enclosing scope.
+  int nestedBypassed = 0;
+  for (int i = 0; i < ROUNDS; i++) {
+    cheap::cheap<cheap::DISABLE_FREE> outer;
+    auto * outerCurrent = current();
+    bool outerActive = (outerCurrent == &outer);
+    {
+      cheap::cheap<cheap::DISABLE_FREE | cheap::SIZE_TAKEN> inner;
+      bool bypassed = (current() != &inner);
+      auto * p = malloc(64);
+      if (outerActive && bypassed) {
+	nestedBypassed++;
+	assert(current()->enclosing() == &outer);
+	assert(theOwnerMap().tag(p) == cheap::owner_map::Scope);
+      }
+      free(p);
+    }
+    assert(current() == outerCurrent);
+  }
+  assert(nestedBypassed > 0);
+  return 0;
+}
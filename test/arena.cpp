@@ -0,0 +1,39 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cheap.h"
+
+// Interleave work on two arenas on one thread, switching between them
+// with cheap::use(), and check that each keeps its contents.
+
+const int NUMDOCS = 2;
+const int NUMNODES = 10000;
+
+int main() {
+  cheap::arena docs[NUMDOCS];
+  static char * nodes[NUMDOCS][NUMNODES];
+  for (int i = 0; i < NUMNODES; i++) {
+    for (int d = 0; d < NUMDOCS; d++) {
+      auto * previous = cheap::use(docs[d]);
+      nodes[d][i] = (char *) malloc(24);
+      snprintf(nodes[d][i], 24, "%d:%d", d, i);
+      cheap::use(previous);
+    }
+  }
+  assert(current() == nullptr);
+  for (int d = 0; d < NUMDOCS; d++) {
+    cheap::use(docs[d]);
+    // realloc needs sizes, which arenas always keep.
+    nodes[d][0] = (char *) realloc(nodes[d][0], 4096);
+    cheap::use(nullptr);
+    for (int i = 0; i < NUMNODES; i++) {
+      char expected[24];
+      snprintf(expected, 24, "%d:%d", d, i);
+      assert(strcmp(nodes[d][i], expected) == 0);
+    }
+    docs[d].clear();
+  }
+  printf("arena: ok\n");
+  return 0;
+}
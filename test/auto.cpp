@@ -0,0 +1,73 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cheap.h"
+#include "harness.h"
+
+// In auto mode (CHEAP_AUTO=1), objects from a site whose allocations
+// die young end up in the nursery; long-lived ones stay in the heap.
+
+const int ROUNDS = 100000;
+const int KEPT = 10000;
+const int NUMTHREADS = 200; // more than the nursery has chunks
+
+void * __attribute__((noinline)) shortLived() {
+  auto ptr = malloc(32);
+  asm volatile ("");
+  return ptr;
+}
+
+void * __attribute__((noinline)) longLived() {
+  auto ptr = malloc(32);
+  asm volatile ("");
+  return ptr;
+}
+
+// Each thread holds a nursery chunk while it runs, and gives it back
+// when it exits.
+void * nurseryUser(void * inNursery) {
+  for (int i = 0; i < 10; i++) {
+    auto * p = shortLived();
+    if (theOwnerMap().tag(p) == cheap::owner_map::Nursery) {
+      *(bool *) inNursery = true;
+    }
+    free(p);
+  }
+  return nullptr;
+}
+
+int main(int, char * argv[]) {
+  if (!getenv("CHEAP_AUTO")) {
+    // Auto mode is chosen when libcheap loads.
+    cheap_test::reexec(argv, { { "CHEAP_AUTO", "1" } });
+  }
+  static void * kept[KEPT];
+  int inNursery = 0;
+  for (int i = 0; i < ROUNDS; i++) {
+    auto * p = shortLived();
+    if (theOwnerMap().tag(p) == cheap::owner_map::Nursery) {
+      inNursery++;
+      assert(malloc_usable_size(p) >= 32);
+    }
+    free(p);
+    if (i % (ROUNDS / KEPT) == 0) {
+      kept[i / (ROUNDS / KEPT)] = longLived();
+    }
+  }
+  assert(inNursery > ROUNDS / 2);
+  for (int i = 0; i < KEPT; i++) {
+    assert(theOwnerMap().tag(kept[i]) != cheap::owner_map::Nursery);
+    free(kept[i]);
+  }
+  for (int i = 0; i < NUMTHREADS; i++) {
+    bool inNursery = false;
+    pthread_t t;
+    pthread_create(&t, nullptr, nurseryUser, &inNursery);
+    pthread_join(t, nullptr);
+    assert(inNursery);
+  }
+  printf("auto: ok\n");
+  return 0;
+}
@@ -0,0 +1,66 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cheap.h"
+
+// calloc in a region scope skips clearing memory the region has never
+// handed out, and still clears memory it has (after rewind or clear,
+// or a chunk it got back from the heap).
+
+const int NUMOBJS = 1000;
+const size_t OBJSIZE = 256;
+const size_t BIGSIZE = 1024 * 1024; // cleared with non-temporal stores
+
+static void * objs[NUMOBJS];
+
+static bool zeroed(const void * ptr, size_t sz) {
+  auto * p = (const unsigned char *) ptr;
+  for (size_t i = 0; i < sz; i++) {
+    if (p[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int main() {
+  {
+    cheap::arena a;
+    auto m = a.mark();
+    auto * p = a.malloc(OBJSIZE);
+    assert(a.untouched(p));
+    memset(p, 0xff, OBJSIZE);
+    a.rewind(m);
+    auto * q = a.malloc(OBJSIZE);
+    assert(q == p);
+    assert(!a.untouched(q));
+    // Past what was handed out before the rewind, it is fresh again.
+    assert(a.untouched(a.malloc(OBJSIZE)));
+    a.clear();
+    assert(!a.untouched(a.malloc(OBJSIZE)));
+  }
+  // Dirty every object in one scope instance, then check that calloc
+  // in the next (which may get the same chunks back) clears them.
+  for (int round = 0; round < 4; round++) {
+    cheap::cheap<cheap::DISABLE_FREE> reg;
+    for (int i = 0; i < NUMOBJS; i++) {
+      objs[i] = calloc(1, OBJSIZE);
+      assert(zeroed(objs[i], OBJSIZE));
+      memset(objs[i], 0xff, OBJSIZE);
+    }
+    auto * big = calloc(BIGSIZE / 16, 16);
+    assert(zeroed(big, BIGSIZE));
+    memset(big, 0xff, BIGSIZE);
+  }
+  // Outside a scope, calloc clears as usual.
+  for (int i = 0; i < NUMOBJS; i++) {
+    objs[i] = calloc(OBJSIZE, 1);
+    assert(zeroed(objs[i], OBJSIZE));
+    memset(objs[i], 0xff, OBJSIZE);
+    free(objs[i]);
+  }
+  printf("calloc: ok\n");
+  return 0;
+}
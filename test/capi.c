@@ -0,0 +1,77 @@
+#include <assert.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "cheap.h"
+
+/* Use cheap scopes from C, including rewinding a region to a mark. */
+
+#define NUMOBJS 10000
+
+int main(void) {
+  static char * objs[NUMOBJS];
+  int i;
+  cheap_handle_t reg = cheap_begin(CHEAP_NONZERO | CHEAP_SINGLE_THREADED | CHEAP_DISABLE_FREE | CHEAP_SIZE_TAKEN, 65536);
+  assert(reg != NULL);
+  objs[0] = (char *) malloc(16);
+  strcpy(objs[0], "kept");
+  cheap_mark_t mark = cheap_mark(reg);
+  for (i = 1; i < NUMOBJS; i++) {
+    objs[i] = (char *) malloc(64);
+    memset(objs[i], i, 64);
+  }
+  cheap_rewind(reg, mark);
+  /* Memory after the mark is reused; memory before it is untouched. */
+  assert(malloc(64) == objs[1]);
+  assert(strcmp(objs[0], "kept") == 0);
+  objs[0] = (char *) realloc(objs[0], 1024);
+  assert(strcmp(objs[0], "kept") == 0);
+  cheap_end(reg);
+
+  cheap_handle_t pool = cheap_begin(CHEAP_ALIGNED | CHEAP_NONZERO | CHEAP_SAME_SIZE, 32);
+  assert(pool != NULL);
+  for (i = 0; i < NUMOBJS; i++) {
+    /* Compare addresses only: the first object is gone. */
+    void * ptr = malloc(32);
+    uintptr_t first = (uintptr_t) ptr;
+    free(ptr);
+    ptr = malloc(32);
+    assert((uintptr_t) ptr == first);
+    free(ptr);
+  }
+  cheap_end(pool);
+
+  /* A same-size region's hint is the object size, not its chunk size:
+     the first objects share the (default-sized) first chunk. */
+  cheap_handle_t same = cheap_begin(CHEAP_NONZERO | CHEAP_SAME_SIZE | CHEAP_DISABLE_FREE, 64);
+  assert(same != NULL);
+  objs[0] = (char *) malloc(64);
+  for (i = 1; i < 32; i++) {
+    objs[i] = (char *) malloc(64);
+    assert((objs[i] > objs[i - 1]) && (objs[i] - objs[i - 1] < 128));
+  }
+  cheap_end(same);
+
+  /* A scope that keeps no sizes refuses realloc rather than copy nothing. */
+  pid_t pid = fork();
+  if (pid == 0) {
+    freopen("/dev/null", "w", stderr);
+    cheap_begin(CHEAP_NONZERO | CHEAP_DISABLE_FREE, 0);
+    char * p = (char *) malloc(16);
+    strcpy(p, "lost");
+    p = (char *) realloc(p, 1024);
+    _exit(strcmp(p, "lost") == 0 ? 0 : 1);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  assert(WIFSIGNALED(status) && (WTERMSIG(status) == SIGABRT));
+
+  assert(cheap_begin(CHEAP_NONZERO, 0) == NULL);
+  printf("capi: ok\n");
+  return 0;
+}
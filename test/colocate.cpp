@@ -0,0 +1,84 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cheap.h"
+
+// With colocate_by_site(), objects from one call site are contiguous
+// even when allocations from different sites interleave.
+
+// Hands out memory and counts how much.
+class CountingRegion {
+public:
+  void * malloc(size_t sz) {
+    bytes += sz;
+    return ::malloc(sz);
+  }
+  size_t bytes = 0;
+};
+
+const int NUMOBJS = 100;
+const int OBJSIZE = 32;
+
+void * __attribute__((noinline)) siteA() {
+  auto ptr = malloc(OBJSIZE);
+  asm volatile ("");
+  return ptr;
+}
+
+void * __attribute__((noinline)) siteB() {
+  auto ptr = malloc(OBJSIZE);
+  asm volatile ("");
+  return ptr;
+}
+
+int main() {
+  static char * a[NUMOBJS];
+  static char * b[NUMOBJS];
+  {
+    cheap::cheap<cheap::DISABLE_FREE> reg;
+    reg.colocate_by_site();
+    for (int i = 0; i < NUMOBJS; i++) {
+      a[i] = (char *) siteA();
+      b[i] = (char *) siteB();
+    }
+    for (int i = 1; i < NUMOBJS; i++) {
+      assert(a[i] == a[i - 1] + OBJSIZE);
+      assert(b[i] == b[i - 1] + OBJSIZE);
+      assert(theOwnerMap().owns(a[i]));
+    }
+    // Large objects still work.
+    auto * big = (char *) malloc(1048576);
+    big[1048575] = 1;
+    assert(theOwnerMap().owns(big));
+  }
+  // Sites that collide in one set keep their slots while there are
+  // ways left; the rest come straight from the region, so alternating
+  // among them does not start a chunk per object.
+  {
+    typedef cheap::site_arenas<CountingRegion> arenas_t;
+    static uintptr_t sites[arenas_t::Ways + 1];
+    int n = 0;
+    for (uintptr_t site = 1; n <= arenas_t::Ways; site++) {
+      if (arenas_t::setOf(site) == arenas_t::setOf(1)) {
+	sites[n++] = site;
+      }
+    }
+    CountingRegion region;
+    static arenas_t arenas(&region);
+    static char * last[arenas_t::Ways + 1];
+    for (int i = 0; i < NUMOBJS; i++) {
+      for (int s = 0; s <= arenas_t::Ways; s++) {
+	auto * p = (char *) arenas.malloc(sites[s], OBJSIZE);
+	if ((i > 0) && (s < arenas_t::Ways)) {
+	  assert(p == last[s] + OBJSIZE);
+	}
+	last[s] = p;
+      }
+    }
+    assert(region.bytes == arenas_t::Ways * arenas_t::ChunkSize + NUMOBJS * OBJSIZE);
+  }
+  printf("colocate: ok\n");
+  return 0;
+}
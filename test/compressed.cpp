@@ -0,0 +1,85 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <type_traits>
+
+#include "cheap.h"
+
+// Build with -DUSE_COMPRESSED_PTRS=1.
+
+class node {
+public:
+  node(int v) : value (v) {}
+  int value;
+  cheap::offset_ptr<node> next;
+  cheap::offset_ptr<node> prev;
+};
+
+static_assert(sizeof(cheap::offset_ptr<node>) == 4, "offset_ptrs are 32 bits.");
+static_assert(sizeof(node) == 12, "Nodes should have shrunk.");
+static_assert(!std::is_copy_constructible<cheap::offset_ptr<node>>::value,
+	      "offset_ptrs are read into raw pointers, not copied.");
+
+const int NUMNODES = 100000;
+
+int main() {
+  node * survivor = nullptr;
+  {
+    cheap::compressed_region reg;
+    node * head = nullptr;
+    for (int i = 0; i < NUMNODES; i++) {
+      auto * n = new node(i);
+      assert(theOwnerMap().owns(n));
+      n->next = head;
+      if (head) {
+	head->prev = n;
+      }
+      head = n;
+    }
+    assert(!head->prev);
+    int count = 0;
+    node * last = nullptr;
+    for (node * n = head; n; n = n->next) {
+      assert(n->value == NUMNODES - 1 - count);
+      last = n;
+      count++;
+    }
+    assert(count == NUMNODES);
+    for (node * n = last; n != head; n = n->prev) {
+      assert(n->prev->next.get() == n);
+    }
+    // Assignments re-encode against their own location.
+    auto * other = new node(-1);
+    other->next = head->next;
+    assert(other->next.get() == head->next.get());
+    node * second = head->next;
+    assert(second == other->next);
+    // Frees are no-ops.
+    delete other;
+    // Sizes are kept, so realloc works.
+    auto * s = (char *) malloc(40);
+    memset(s, 'a', 40);
+    assert(malloc_usable_size(s) == 48);
+    s = (char *) realloc(s, 1000);
+    for (int i = 0; i < 40; i++) {
+      assert(s[i] == 'a');
+    }
+    assert(malloc_usable_size(s) == 1008);
+    survivor = head;
+  }
+  // The region's memory is released, but freeing it is still ignored.
+  delete survivor;
+  {
+    cheap::compressed_region reg;
+    auto * n = new node(1);
+    assert(theOwnerMap().owns(n));
+  }
+  // Back outside the scope.
+  auto * p = malloc(32);
+  assert(!theOwnerMap().owns(p));
+  free(p);
+  printf("compressed: ok\n");
+  return 0;
+}
@@ -0,0 +1,43 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cheap.h"
+#include "harness.h"
+
+// Build with -finstrument-functions -rdynamic, and link with a libcheap
+// built with USE_CONFIGURED_SCOPES=1. CHEAP_SCOPES puts a
+// region around every call to build(), with no cheap declaration here.
+
+extern "C" bool __attribute__((noinline)) build(int n) {
+  bool owned = true;
+  for (int i = 0; i < n; i++) {
+    owned &= theOwnerMap().owns(malloc(64));
+  }
+  return owned;
+}
+
+extern "C" bool __attribute__((noinline)) recurse(int depth) {
+  if (depth == 0) {
+    return theOwnerMap().owns(malloc(64));
+  }
+  auto owned = recurse(depth - 1);
+  asm volatile ("");
+  return owned;
+}
+
+int main(int, char * argv[]) {
+  if (!getenv("CHEAP_SCOPES")) {
+    // The configuration is read when libcheap loads.
+    cheap_test::reexec(argv, { { "CHEAP_SCOPES", "build DISABLE_FREE 0; recurse DISABLE_FREE" } });
+  }
+  assert(build(100));
+  assert(current() == nullptr || !current()->in_cheap);
+  assert(recurse(10));
+  assert(current() == nullptr || !current()->in_cheap);
+  auto * p = malloc(64);
+  assert(!theOwnerMap().owns(p));
+  free(p);
+  printf("config: ok\n");
+  return 0;
+}
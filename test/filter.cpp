@@ -0,0 +1,49 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cheap.h"
+
+// Only allocations made from captured() (directly or through its
+// callees) come from the scope.
+
+void * __attribute__((noinline)) helper(size_t sz) {
+  return malloc(sz);
+}
+
+void * __attribute__((noinline)) captured(size_t sz) {
+  auto ptr = helper(sz);
+  asm volatile ("");
+  return ptr;
+}
+
+void * __attribute__((noinline)) uncaptured(size_t sz) {
+  auto ptr = malloc(sz);
+  asm volatile ("");
+  return ptr;
+}
+
+int main() {
+  cheap::site_filter filter;
+  bool ok = filter.add_function((void *) &captured);
+  assert(ok);
+  {
+    cheap::cheap<cheap::DISABLE_FREE> reg;
+    reg.capture_only(filter);
+    auto * in = captured(64);
+    auto * out = uncaptured(64);
+    assert(theOwnerMap().owns(in));
+    assert(!theOwnerMap().owns(out));
+    free(out);
+  }
+  cheap::site_filter everything;
+  ok = everything.add_object((void *) &main);
+  assert(ok);
+  {
+    cheap::cheap<cheap::DISABLE_FREE> reg;
+    reg.capture_only(everything);
+    assert(theOwnerMap().owns(uncaptured(64)));
+  }
+  printf("filter: ok\n");
+  return 0;
+}
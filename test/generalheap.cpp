@@ -0,0 +1,107 @@
+#include <assert.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cheap.h"
+
+// Exercises GeneralHeap directly, then through a libcheap built with
+// USE_GENERAL_HEAP=1 (libcheap-generalheap).
+
+const int ROUNDS = 100;
+const int NEIGHBOURS = 64;
+
+static bool general(const void * ptr) {
+  auto tag = theOwnerMap().tag(ptr);
+  return (tag >= GeneralHeap::FirstClassTag) && (tag <= GeneralHeap::LargeTag);
+}
+
+// Fixed-buffer scopes carved out of general-heap objects (small ones
+// sharing their pages with neighbours of the same class, and large
+// ones), while those neighbours are freed, measured and reallocated.
+static void fixedBuffers() {
+  static char * neighbours[NEIGHBOURS];
+  for (int round = 0; round < ROUNDS; round++) {
+    size_t objSz = 1000 + (round % 4) * 8;
+    size_t bufSz = (round % 2) ? objSz : 100000;
+    for (int i = 0; i < NEIGHBOURS / 2; i++) {
+      neighbours[i] = (char *) malloc(objSz);
+    }
+    auto * buf = (char *) malloc(bufSz);
+    for (int i = NEIGHBOURS / 2; i < NEIGHBOURS; i++) {
+      neighbours[i] = (char *) malloc(objSz);
+    }
+    assert(general(buf));
+    for (int i = 0; i < NEIGHBOURS; i++) {
+      assert(general(neighbours[i]));
+      memset(neighbours[i], i, objSz);
+    }
+    {
+      cheap::cheap<cheap::DISABLE_FREE | cheap::SIZE_TAKEN | cheap::FIXED_BUFFER> reg(8, buf, bufSz);
+      auto * p = (char *) malloc(64);
+      assert((p > buf) && (p < buf + bufSz));
+      assert(malloc_usable_size(p) == 64);
+      // Neighbours keep their size classes, and free to the general
+      // heap even from inside the scope.
+      for (int i = 0; i < NEIGHBOURS; i++) {
+	assert(!theOwnerMap().owns(neighbours[i]));
+	assert(malloc_usable_size(neighbours[i]) >= objSz);
+	if (i % 2) {
+	  free(neighbours[i]);
+	  neighbours[i] = nullptr;
+	}
+      }
+      free(p);
+    }
+    assert(general(buf));
+    assert(malloc_usable_size(buf) >= bufSz);
+    for (int i = 0; i < NEIGHBOURS; i++) {
+      if (neighbours[i]) {
+	for (size_t j = 0; j < objSz; j++) {
+	  assert(neighbours[i][j] == (char) i);
+	}
+	free(neighbours[i]);
+      } else {
+	// The general heap hands freed neighbours out again.
+	neighbours[i] = (char *) malloc(objSz);
+	assert(general(neighbours[i]));
+	free(neighbours[i]);
+      }
+    }
+    free(buf);
+  }
+}
+
+int main() {
+  // Size classes cover every small size exactly once, in order.
+  for (size_t sz = 1; sz <= GeneralHeap::MaxSmall; sz++) {
+    auto c = GeneralHeap::sizeClass(sz);
+    assert(c >= 0 && c < GeneralHeap::NumClasses);
+    assert(GeneralHeap::classSize(c) >= sz);
+    assert((c == 0) || (GeneralHeap::classSize(c - 1) < sz));
+  }
+  GeneralHeap heap;
+  static void * ptrs[10000];
+  for (int i = 0; i < 10000; i++) {
+    size_t sz = (i * 37) % 50000;
+    ptrs[i] = heap.malloc(sz);
+    assert(ptrs[i] != nullptr);
+    assert(heap.getSize(ptrs[i]) >= sz);
+    memset(ptrs[i], i & 0xff, sz);
+  }
+  for (int i = 0; i < 10000; i++) {
+    assert(heap.free(ptrs[i]));
+  }
+  for (size_t align = 32; align <= 4 * 1048576; align *= 2) {
+    auto * ptr = heap.memalign(align, 24);
+    assert(((uintptr_t) ptr & (align - 1)) == 0);
+    heap.free(ptr);
+  }
+  // Memory the heap never handed out is ignored.
+  static char foreign[64];
+  assert(!heap.free(foreign));
+  fixedBuffers();
+  printf("generalheap: ok\n");
+  return 0;
+}
@@ -0,0 +1,48 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cheap.h"
+#include "harness.h"
+
+// CHEAP_CHUNK_SIZE, CHEAP_CHUNK_GROWTH, CHEAP_MAX_CHUNK_SIZE and
+// CHEAP_RETAIN set the geometry of every region, at load.
+
+const int NUMOBJS = 1024;
+const size_t OBJSIZE = 1024;
+
+int main(int, char * argv[]) {
+  if (!getenv("CHEAP_CHUNK_SIZE")) {
+    // By default: one 3MB chunk holds 1MB.
+    {
+      cheap::arena a;
+      for (int i = 0; i < NUMOBJS; i++) {
+	assert(a.malloc(OBJSIZE));
+      }
+      assert(a.refills() == 1);
+    }
+    cheap_test::runChild(argv, { { "CHEAP_CHUNK_SIZE", "64k" },
+				 { "CHEAP_CHUNK_GROWTH", "1.5" },
+				 { "CHEAP_MAX_CHUNK_SIZE", "128k" },
+				 { "CHEAP_RETAIN", "4m" } });
+    printf("geometry: ok\n");
+    return 0;
+  }
+  assert(CheapRegionHeap::defaultChunkSize() == 64 * 1024);
+  cheap::arena a;
+  for (int i = 0; i < NUMOBJS; i++) {
+    assert(a.malloc(OBJSIZE));
+  }
+  // 64k, 96k, then 128k chunks: at least 8 of them for 1MB.
+  auto refills = a.refills();
+  auto bytes = a.refilledBytes();
+  assert(refills >= 8);
+  assert(bytes <= refills * 128 * 1024);
+  // Cleared chunks (well under 4MB) are reused, not obtained again.
+  a.clear();
+  for (int i = 0; i < NUMOBJS; i++) {
+    assert(a.malloc(OBJSIZE));
+  }
+  assert(a.refilledBytes() == bytes);
+  return 0;
+}
@@ -0,0 +1,121 @@
+/* -*- C++ -*- */
+
+#pragma once
+
+#ifndef TEST_HARNESS_H
+#define TEST_HARNESS_H
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <initializer_list>
+
+// For tests of settings libcheap reads from the environment when it
+// loads: re-run the test program with them set, and read the report
+// it leaves behind.
+
+namespace cheap_test {
+
+  /// An environment variable to set for the re-run program.
+  class setting {
+  public:
+    const char * name;
+    const char * value;
+  };
+
+  /// Set vars and re-execute this program in place. Does not return.
+  inline void reexec(char * argv[], std::initializer_list<setting> vars) {
+    for (auto& v : vars) {
+      setenv(v.name, v.value, 1);
+    }
+    execv("/proc/self/exe", argv);
+    _exit(1);
+  }
+
+  /// Re-run this program in a child with vars set, and check that it
+  /// exits successfully.
+  inline void runChild(char * argv[], std::initializer_list<setting> vars) {
+    auto pid = fork();
+    if (pid == 0) {
+      reexec(argv, vars);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+  }
+
+  /// A temporary file for a child to write its report to (pass path()
+  /// as CHEAP_STATS_FILE or the like); removed when done.
+  class report_file {
+  public:
+    report_file() {
+      int fd = mkstemp(_path);
+      assert(fd >= 0);
+      close(fd);
+    }
+
+    ~report_file() {
+      unlink(_path);
+    }
+
+    const char * path() const {
+      return _path;
+    }
+
+    /// Read the whole report into buf (NUL-terminated); returns its length.
+    size_t read(char * buf, size_t size) const {
+      auto * f = fopen(_path, "r");
+      assert(f);
+      auto n = fread(buf, 1, size - 1, f);
+      buf[n] = '\0';
+      fclose(f);
+      return n;
+    }
+
+    /// Call fn on each line of the report.
+    template <class Fn>
+    void forEachLine(Fn fn) const {
+      auto * f = fopen(_path, "r");
+      assert(f);
+      char line[1024];
+      while (fgets(line, sizeof(line), f)) {
+	fn(line);
+      }
+      fclose(f);
+    }
+
+  private:
+    char _path[32] = "/tmp/cheap-test-XXXXXX";
+  };
+
+  /// The tab-separated field numbered n (from 0) of line.
+  inline const char * field(const char * line, int n) {
+    while (n-- > 0) {
+      line = strchr(line, '\t');
+      if (!line) {
+	return "";
+      }
+      line++;
+    }
+    return line;
+  }
+
+  /// The number of the column named name in the header line, or -1.
+  inline int column(const char * header, const char * name) {
+    auto len = strlen(name);
+    for (int i = 0; *field(header, i); i++) {
+      auto * f = field(header, i);
+      if ((strncmp(f, name, len) == 0) && ((f[len] == '\t') || (f[len] == '\n'))) {
+	return i;
+      }
+    }
+    return -1;
+  }
+
+}
+
+#endif
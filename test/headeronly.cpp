@@ -0,0 +1,30 @@
+#include <assert.h>
+#include <stdio.h>
+
+// Built with -DCHEAP_HEADER_ONLY=1 and without libcheap.
+#include "cheap_new.h"
+
+const int NUMOBJS = 100000;
+
+int main() {
+  static char * objs[NUMOBJS];
+  char * before = new char[16];
+  {
+    cheap::cheap<cheap::NONZERO | cheap::SINGLE_THREADED | cheap::DISABLE_FREE> reg;
+    for (int i = 0; i < NUMOBJS; i++) {
+      objs[i] = new char[16];
+      assert(theOwnerMap().owns(objs[i]));
+    }
+    // Foreign memory still goes back to the system allocator.
+    delete [] before;
+    for (int i = 0; i < NUMOBJS; i++) {
+      delete [] objs[i];
+    }
+  }
+  assert(current() == nullptr);
+  char * after = new char[16];
+  assert(!theOwnerMap().owns(after));
+  delete [] after;
+  printf("headeronly: ok\n");
+  return 0;
+}
@@ -0,0 +1,67 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <thread>
+
+#include "cheap.h"
+
+// Threads created inside an INHERIT_THREADS scope allocate from their
+// own sub-arena, which stays valid until the parent scope ends.
+
+const int NUMTHREADS = 4;
+const int NUMOBJS = 10000;
+
+void worker(char ** result) {
+  assert(current() && current()->in_cheap);
+  for (int i = 0; i < NUMOBJS; i++) {
+    result[i] = new char[32];
+    result[i][0] = (char) i;
+  }
+}
+
+// A thread that leaves through pthread_exit is out of the scope by the
+// time its thread-specific data destructors run.
+
+static pthread_key_t key;
+static bool leftScope = false;
+
+static void checkLeft(void *) {
+  leftScope = (current() == nullptr);
+}
+
+static void * exiter(void * kept) {
+  pthread_setspecific(key, (void *) 1);
+  *(char **) kept = new char[32];
+  pthread_exit(nullptr);
+}
+
+int main() {
+  static char * objs[NUMTHREADS][NUMOBJS];
+  char * kept = nullptr;
+  pthread_key_create(&key, checkLeft);
+  {
+    cheap::cheap<cheap::NONZERO | cheap::DISABLE_FREE | cheap::INHERIT_THREADS> reg;
+    std::thread * t[NUMTHREADS];
+    for (auto i = 0; i < NUMTHREADS; i++) {
+      t[i] = new std::thread(worker, objs[i]);
+    }
+    for (auto i = 0; i < NUMTHREADS; i++) {
+      t[i]->join();
+      delete t[i];
+    }
+    for (auto i = 0; i < NUMTHREADS; i++) {
+      for (auto j = 0; j < NUMOBJS; j++) {
+	assert(objs[i][j][0] == (char) j);
+	delete [] objs[i][j];
+      }
+    }
+    pthread_t p;
+    pthread_create(&p, nullptr, exiter, &kept);
+    pthread_join(p, nullptr);
+    assert(leftScope);
+  }
+  // The child's sub-arena is gone; freeing what it allocated is ignored.
+  delete [] kept;
+  printf("inherit: ok\n");
+  return 0;
+}
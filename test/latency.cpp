@@ -0,0 +1,74 @@
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cheap.h"
+#include "harness.h"
+
+// With CHEAP_LATENCY=<n>, libcheap times xxmalloc/xxfree by path and
+// reports the histograms at exit and after CHEAP_LATENCY_SIGNAL (at the
+// next sampled call).
+
+const int NUMOBJS = 100000;
+
+int main(int, char * argv[]) {
+  if (!getenv("CHEAP_LATENCY")) {
+    cheap_test::report_file stats;
+    cheap_test::runChild(argv, { { "CHEAP_LATENCY", "1" },
+				 { "CHEAP_LATENCY_SIGNAL", "12" }, // SIGUSR2
+				 { "CHEAP_STATS_FILE", stats.path() } });
+    int reports = 0;
+    const char * paths[] = { "malloc\tregion-bump\t", "malloc\tregion-refill\t",
+			     "malloc\tfreelist-hit\t", "malloc\tfreelist-miss\t",
+			     "malloc\tfallback\t", "free\tregion-ignored\t",
+			     "free\tfreelist\t", "free\tfallback\t" };
+    bool seen[sizeof(paths) / sizeof(paths[0])] = {};
+    stats.forEachLine([&](const char * line) {
+      if (strncmp(line, "# cheap latency", 15) == 0) {
+	reports++;
+      }
+      for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+	if (strncmp(line, paths[i], strlen(paths[i])) == 0) {
+	  seen[i] = true;
+	}
+      }
+    });
+    // One report on the signal, one at exit.
+    assert(reports == 2);
+    for (auto s : seen) {
+      assert(s);
+    }
+    printf("latency: ok\n");
+    return 0;
+  }
+  static void * objs[NUMOBJS];
+  {
+    // 10MB: more than the region's first chunk.
+    cheap::cheap<cheap::DISABLE_FREE> reg;
+    for (int i = 0; i < NUMOBJS; i++) {
+      objs[i] = malloc(100);
+    }
+    for (int i = 0; i < NUMOBJS; i++) {
+      free(objs[i]);
+    }
+  }
+  {
+    cheap::cheap<cheap::SAME_SIZE> fl(64);
+    for (int round = 0; round < 2; round++) {
+      for (int i = 0; i < 1000; i++) {
+	objs[i] = malloc(64);
+      }
+      for (int i = 0; i < 1000; i++) {
+	free(objs[i]);
+      }
+    }
+  }
+  objs[0] = malloc(64);
+  free(objs[0]);
+  raise(SIGUSR2);
+  objs[0] = malloc(64);
+  free(objs[0]);
+  return 0;
+}
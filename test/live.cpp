@@ -0,0 +1,47 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "cheap.h"
+#include "harness.h"
+#include "livestats.h"
+
+// With CHEAP_LIVE=1, libcheap publishes per-site totals in a shared
+// memory segment (what cheap-top reads); here, the process reads its own.
+
+const int ROUNDS = 100;
+
+int main(int, char * argv[]) {
+  if (!getenv("CHEAP_LIVE")) {
+    // Live stats are set up when libcheap loads.
+    cheap_test::reexec(argv, { { "CHEAP_LIVE", "1" } });
+  }
+  for (int i = 0; i < ROUNDS; i++) {
+    cheap::cheap<cheap::DISABLE_FREE> reg;
+    for (int j = 0; j <= i; j++) {
+      auto * p = malloc(64);
+      asm volatile ("" :: "r" (p));
+    }
+  }
+  char name[64];
+  cheap::live_stats::segmentName(name, sizeof(name), getpid());
+  int fd = shm_open(name, O_RDONLY, 0);
+  assert(fd >= 0);
+  auto * page = (const cheap::live_stats *) mmap(nullptr, sizeof(cheap::live_stats), PROT_READ, MAP_SHARED, fd, 0);
+  assert(page != MAP_FAILED);
+  close(fd);
+  assert(page->magic == cheap::live_stats::Magic);
+  assert(page->count.load() == 1);
+  auto& site = page->sites[0];
+  assert(strstr(site.name, "live.cpp"));
+  assert(site.entries.load() == ROUNDS);
+  assert(site.bytes.load() == 64 * ROUNDS * (ROUNDS + 1) / 2);
+  assert(site.peak.load() == 64 * ROUNDS);
+  assert(site.spills.load() == 0);
+  printf("live: ok\n");
+  return 0;
+}
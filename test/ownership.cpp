@@ -0,0 +1,97 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cheap.h"
+
+// Frees are routed by address: memory allocated before a scope opened
+// goes back to the system allocator even when freed inside the scope.
+
+const int NUMOBJS = 1000;
+const int OBJSIZE = 64;
+const int BUFSIZE = 1000;
+
+static inline uintptr_t page(const void * ptr) {
+  return (uintptr_t) ptr >> cheap::owner_map::PageShift;
+}
+
+int main() {
+  static void * before[NUMOBJS];
+  for (int i = 0; i < NUMOBJS; i++) {
+    before[i] = malloc(OBJSIZE);
+  }
+  {
+    cheap::cheap<cheap::ALIGNED | cheap::NONZERO | cheap::SAME_SIZE | cheap::SINGLE_THREADED> reg(OBJSIZE);
+    for (int i = 0; i < NUMOBJS; i++) {
+      free(before[i]);
+    }
+    // None of the foreign objects may have landed on the scope's freelist.
+    for (int i = 0; i < NUMOBJS; i++) {
+      void * ptr = malloc(OBJSIZE);
+      for (int j = 0; j < NUMOBJS; j++) {
+	assert(ptr != before[j]);
+      }
+      free(ptr);
+    }
+  }
+  // Scope memory that is not the current scope's (an enclosing scope's
+  // objects, or an arena's) stays off its freelist too.
+  {
+    cheap::arena a;
+    cheap::cheap<cheap::ALIGNED | cheap::NONZERO | cheap::SAME_SIZE | cheap::SINGLE_THREADED> outer(OBJSIZE);
+    for (int i = 0; i < NUMOBJS; i++) {
+      before[i] = (i % 2) ? malloc(OBJSIZE) : a.malloc(OBJSIZE);
+    }
+    {
+      cheap::cheap<cheap::ALIGNED | cheap::NONZERO | cheap::SAME_SIZE> inner(OBJSIZE);
+      for (int i = 0; i < NUMOBJS; i++) {
+	free(before[i]);
+      }
+      for (int i = 0; i < NUMOBJS; i++) {
+	void * ptr = malloc(OBJSIZE);
+	for (int j = 0; j < NUMOBJS; j++) {
+	  assert(ptr != before[j]);
+	}
+      }
+    }
+  }
+  // Memory an arena (or any other cheap heap) releases stays reserved,
+  // so freeing an object that outlived it is still ignored.
+  {
+    void * ptr;
+    {
+      cheap::arena a;
+      ptr = a.malloc(OBJSIZE);
+    }
+    assert(theOwnerMap().tag(ptr) != cheap::owner_map::Foreign);
+    free(ptr);
+  }
+  // A fixed buffer owns just its own bytes: a heap object on the page
+  // where it starts still goes back to the heap.
+  char * neighbour = nullptr;
+  char * buf = nullptr;
+  for (int i = 0; (i < NUMOBJS) && !neighbour; i++) {
+    auto * a = (char *) malloc(OBJSIZE);
+    auto * b = (char *) malloc(BUFSIZE);
+    if ((page(a) == page(b)) && (page(b) != page(b + BUFSIZE - 1))) {
+      neighbour = a;
+      buf = b;
+    }
+  }
+  assert(neighbour);
+  {
+    cheap::cheap<cheap::DISABLE_FREE | cheap::SIZE_TAKEN | cheap::FIXED_BUFFER> reg(8, buf, BUFSIZE);
+    auto * p = (char *) malloc(OBJSIZE);
+    assert((p > buf) && (p < buf + BUFSIZE));
+    assert(theOwnerMap().owns(p) && theOwnerMap().owns(buf + BUFSIZE - 1));
+    assert(!theOwnerMap().owns(neighbour));
+    assert(malloc_usable_size(neighbour) >= (size_t) OBJSIZE);
+    assert(malloc_usable_size(p) == (size_t) OBJSIZE);
+    free(p);
+    free(neighbour);
+  }
+  assert(!theOwnerMap().owns(buf));
+  free(buf);
+  printf("ownership: ok\n");
+  return 0;
+}
@@ -0,0 +1,95 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cheap.h"
+#include "harness.h"
+#include "perfcounters.h"
+
+// With CHEAP_PERF=1, libcheap reads perf counters (hardware ones, or
+// software ones where there is no PMU) around each scope instance.
+
+const int ROUNDS = 100;
+const int WORK = 1000000;
+
+// Whichever set opens, its counters are read as a group, so they
+// must agree with each other over the same stretch of work.
+static void checkConsistent() {
+  static const cheap::perf_counters::kind kinds[] = { cheap::perf_counters::Hardware, cheap::perf_counters::Software };
+  cheap::perf_counters counters;
+  for (auto k : kinds) {
+    if (!counters.open(k)) {
+      continue;
+    }
+    uint64_t before[cheap::NumPerfCounters];
+    uint64_t after[cheap::NumPerfCounters];
+    uint64_t d[cheap::NumPerfCounters];
+    counters.read(before);
+    volatile char buf[1 << 16];
+    for (int i = 0; i < WORK; i++) {
+      buf[(i * 64) % sizeof(buf)] = (char) i;
+    }
+    counters.read(after);
+    counters.close();
+    for (int i = 0; i < cheap::NumPerfCounters; i++) {
+      assert(after[i] >= before[i]);
+      d[i] = after[i] - before[i];
+    }
+    if (k == cheap::perf_counters::Hardware) {
+      // cycles, instructions, L1D, LLC and dTLB misses: the loop runs
+      // at least one instruction per iteration, at a sane IPC, and
+      // misses at most once per instruction.
+      assert(d[0] > 0);
+      assert(d[1] >= (uint64_t) WORK);
+      assert(d[1] < 16 * d[0]);
+      assert(d[0] < 64 * d[1]);
+      for (int i = 2; i < cheap::NumPerfCounters; i++) {
+	assert(d[i] <= d[1]);
+      }
+    } else {
+      // task clock, page faults (all, minor, major), context switches.
+      assert(d[0] > 0);
+      assert(d[2] + d[3] <= d[1]);
+    }
+  }
+}
+
+int main(int, char * argv[]) {
+  using cheap_test::field;
+  if (!getenv("CHEAP_PERF")) {
+    checkConsistent();
+    cheap_test::report_file stats;
+    cheap_test::runChild(argv, { { "CHEAP_PERF", "1" }, { "CHEAP_STATS_FILE", stats.path() } });
+    int column = -1;
+    bool counted = false;
+    stats.forEachLine([&](const char * line) {
+      if (strncmp(line, "# scope\t", 8) == 0) {
+	// The first counter: cycles, or task-clock without a PMU.
+	column = cheap_test::column(line, "perf_cycles");
+	if (column < 0) {
+	  column = cheap_test::column(line, "perf_task_clock_ns");
+	}
+      } else if (strstr(line, "perf.cpp") && strstr(line, "\tscoped\t")) {
+	assert(column > 0);
+	counted = (atof(field(line, column)) > 0);
+      }
+    });
+    if (column < 0) {
+      // perf_event_open is not allowed here at all.
+      printf("perf: skipped\n");
+      return 0;
+    }
+    assert(counted);
+    printf("perf: ok\n");
+    return 0;
+  }
+  for (int i = 0; i < ROUNDS; i++) {
+    cheap::cheap<cheap::DISABLE_FREE> reg;
+    for (int j = 0; j < 1000; j++) {
+      auto * p = malloc(64);
+      asm volatile ("" :: "r" (p));
+    }
+  }
+  return 0;
+}
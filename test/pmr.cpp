@@ -0,0 +1,50 @@
+#include <assert.h>
+#include <stdio.h>
+
+#include <map>
+#include <memory_resource>
+#include <string>
+#include <vector>
+
+#include "cheap_pmr.h"
+
+// Use each cheap memory resource directly from pmr containers (no
+// libcheap needed).
+
+template <class Resource>
+void exercise(Resource& mr) {
+  std::pmr::vector<int> v(&mr);
+  std::pmr::map<int, std::pmr::string> m(&mr);
+  for (int i = 0; i < 100000; i++) {
+    v.push_back(i);
+    m.emplace(i, std::pmr::string("a string long enough to need the heap", &mr));
+  }
+  for (int i = 0; i < 100000; i++) {
+    assert(v[i] == i);
+    assert(m[i].size() == 37);
+  }
+  m.clear();
+  // Over-aligned requests must still be honored.
+  void * ptr = mr.allocate(100, 256);
+  assert(((uintptr_t) ptr & 255) == 0);
+  mr.deallocate(ptr, 100, 256);
+}
+
+int main() {
+  {
+    cheap::monotonic_resource mr;
+    exercise(mr);
+    mr.release();
+  }
+  {
+    cheap::pool_resource mr;
+    exercise(mr);
+  }
+  {
+    static char buf[65536];
+    cheap::buffer_resource mr(buf, sizeof(buf));
+    exercise(mr);
+  }
+  printf("pmr: ok\n");
+  return 0;
+}
@@ -0,0 +1,69 @@
+#include <assert.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Built with -DCHEAP_HEADER_ONLY=1: the scope and chunk probes of
+// probes.h must show up as stapsdt notes in this executable.
+#include "cheap_new.h"
+
+/// Whether the .note.stapsdt section of image has cheap:name.
+static bool hasProbe(const char * image, const char * name) {
+  auto * ehdr = (const Elf64_Ehdr *) image;
+  auto * shdrs = (const Elf64_Shdr *) (image + ehdr->e_shoff);
+  auto * strings = image + shdrs[ehdr->e_shstrndx].sh_offset;
+  for (int i = 0; i < ehdr->e_shnum; i++) {
+    if (strcmp(strings + shdrs[i].sh_name, ".note.stapsdt") != 0) {
+      continue;
+    }
+    auto * p = image + shdrs[i].sh_offset;
+    auto * end = p + shdrs[i].sh_size;
+    while (p < end) {
+      auto * note = (const Elf64_Nhdr *) p;
+      // The descriptor: pc, base and semaphore addresses, then the
+      // provider, name and argument strings.
+      auto * desc = p + sizeof(*note) + ((note->n_namesz + 3) & ~3);
+      auto * provider = desc + 3 * sizeof(uint64_t);
+      auto * probe = provider + strlen(provider) + 1;
+      if ((strcmp(provider, "cheap") == 0) && (strcmp(probe, name) == 0)) {
+	return true;
+      }
+      p = desc + ((note->n_descsz + 3) & ~3);
+    }
+  }
+  return false;
+}
+
+int main() {
+#if USE_PROBES && defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+  int fd = open("/proc/self/exe", O_RDONLY);
+  assert(fd >= 0);
+  struct stat st;
+  fstat(fd, &st);
+  auto * image = (const char *) mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  assert(image != MAP_FAILED);
+  close(fd);
+  const char * probes[] = { "scope_begin", "scope_end", "refill", "release", "chunk_map", "chunk_unmap" };
+  for (auto * name : probes) {
+    assert(hasProbe(image, name));
+  }
+#endif
+  // The probes are nops: scopes work as usual.
+  static char * objs[1000];
+  {
+    cheap::cheap<cheap::DISABLE_FREE> reg;
+    for (int i = 0; i < 1000; i++) {
+      objs[i] = new char[16];
+      assert(theOwnerMap().owns(objs[i]));
+    }
+    for (int i = 0; i < 1000; i++) {
+      delete [] objs[i];
+    }
+  }
+  printf("probes: ok\n");
+  return 0;
+}
@@ -0,0 +1,74 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cheap.h"
+#include "harness.h"
+
+// With CHEAP_RSS=1, libcheap reports per scope the page faults, region
+// bytes obtained, and resident set growth and peak of its instances.
+
+const int NUMOBJS = 10000;
+const size_t OBJSIZE = 1024;
+const size_t PEAKSIZE = 32 * 1024 * 1024;
+
+// Touch PEAKSIZE bytes of region memory: the region gives them back as
+// the scope ends, so the resident set is down again when that is
+// measured, but the scope's peak is not.
+static const int peakLine = __LINE__ + 2;
+static void peak() {
+  cheap::cheap<cheap::DISABLE_FREE> reg;
+  for (size_t done = 0; done < PEAKSIZE; done += PEAKSIZE / 32) {
+    auto * p = (char *) malloc(PEAKSIZE / 32);
+    memset(p, 1, PEAKSIZE / 32);
+    asm volatile ("" :: "r" (p) : "memory");
+  }
+}
+
+int main(int, char * argv[]) {
+  using cheap_test::column;
+  using cheap_test::field;
+  if (!getenv("CHEAP_RSS")) {
+    cheap_test::report_file stats;
+    cheap_test::runChild(argv, { { "CHEAP_RSS", "1" }, { "CHEAP_STATS_FILE", stats.path() } });
+    char header[1024] = "";
+    char peakSite[32];
+    snprintf(peakSite, sizeof(peakSite), "rss.cpp:%d\t", peakLine);
+    bool seen = false;
+    bool seenPeak = false;
+    stats.forEachLine([&](const char * line) {
+      if (strncmp(line, "# scope\t", 8) == 0) {
+	strcpy(header, line);
+      } else if (strstr(line, peakSite) && strstr(line, "\tscoped\t")) {
+	auto peak = column(header, "rss_peak");
+	assert(peak > 0);
+	assert(atof(field(line, peak)) >= PEAKSIZE);
+	seenPeak = true;
+      } else if (strstr(line, "rss.cpp") && strstr(line, "\tscoped\t")) {
+	auto minor = column(header, "minor_faults");
+	auto mapped = column(header, "mapped_bytes");
+	auto peak = column(header, "rss_peak");
+	assert((minor > 0) && (mapped > 0) && (peak > 0));
+	// Touching 10MB of fresh region memory faults it in.
+	assert(atof(field(line, minor)) > 0);
+	assert(atof(field(line, mapped)) >= NUMOBJS * OBJSIZE);
+	assert(atof(field(line, peak)) >= NUMOBJS * OBJSIZE);
+	seen = true;
+      }
+    });
+    assert(seen && seenPeak);
+    printf("rss: ok\n");
+    return 0;
+  }
+  peak();
+  {
+    cheap::cheap<cheap::DISABLE_FREE> reg;
+    for (int i = 0; i < NUMOBJS; i++) {
+      auto * p = (char *) malloc(OBJSIZE);
+      memset(p, i, OBJSIZE);
+      asm volatile ("" :: "r" (p) : "memory");
+    }
+  }
+  return 0;
+}
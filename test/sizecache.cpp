@@ -0,0 +1,98 @@
+#include <assert.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cheap.h"
+
+// Exercises cheap::size_cache directly, then through a libcheap built
+// with USE_SIZE_CACHES=1 (libcheap-sizecache).
+
+class CountingHeap {
+public:
+  void free(void * ptr) {
+    ::free(ptr);
+    frees++;
+  }
+  int frees = 0;
+};
+
+int main() {
+  typedef cheap::size_cache cache_t;
+  // An object may only serve requests no larger than its usable size.
+  for (size_t usable = 1; usable <= 2 * cache_t::MaxSize; usable++) {
+    auto c = cache_t::objectClass(usable);
+    for (size_t sz = 1; sz <= cache_t::MaxSize; sz++) {
+      if (cache_t::requestClass(sz) == c) {
+	assert(sz <= usable);
+      }
+    }
+  }
+  static cache_t cache;
+  CountingHeap heap;
+  void * a = malloc(64);
+  assert(cache.put(0, a, 64, heap));
+  assert(cache.get(0, 80) == nullptr);
+  assert(cache.get(1, 64) == nullptr);
+  assert(cache.get(0, 50) == a);
+  assert(cache.get(0, 50) == nullptr);
+  // Switching owners returns custom-heap objects to the heap...
+  for (int i = 0; i < 10; i++) {
+    assert(cache.put(0, malloc(32), 32, heap));
+  }
+  static char scopeObjects[10][32];
+  assert(cache.put(7, scopeObjects[0], 32, heap));
+  assert(heap.frees == 10);
+  // ...but simply drops scope objects.
+  for (int i = 1; i < 10; i++) {
+    assert(cache.put(7, scopeObjects[i], 32, heap));
+  }
+  assert(cache.put(0, a, 64, heap));
+  assert(heap.frees == 10);
+  // Classes are bounded.
+  static char more[cache_t::Capacity + 1][16];
+  for (int i = 0; i < cache_t::Capacity; i++) {
+    assert(cache.put(0, more[i], 16, heap));
+  }
+  assert(!cache.put(0, more[cache_t::Capacity], 16, heap));
+  assert(!cache.put(0, more[0], 8, heap));
+  // Objects too large for the top class are not cached at all.
+  static char huge[2 * cache_t::MaxSize];
+  assert(cache_t::objectClass(cache_t::MaxSize) == cache_t::NumClasses - 1);
+  assert(cache_t::objectClass(cache_t::MaxSize + 1) < 0);
+  assert(!cache.put(0, huge, sizeof(huge), heap));
+  // A heap object freed inside a scope is cached like one freed outside
+  // it: it serves the smallest request of its class, which the heap
+  // itself would serve from a smaller size class.
+  for (int inScope = 0; inScope < 2; inScope++) {
+    void * obj = malloc(136);
+    auto c = cache_t::objectClass(malloc_usable_size(obj));
+    assert(c > 0);
+    if (inScope) {
+      cheap::cheap<cheap::DISABLE_FREE> reg;
+      free(obj);
+    } else {
+      free(obj);
+    }
+    auto * again = malloc(c * cache_t::Granularity + 1);
+    assert(again == obj);
+    free(again);
+  }
+  // A freed large block goes back to the heap rather than serving (and
+  // pinning) small requests.
+  for (int inScope = 0; inScope < 2; inScope++) {
+    const size_t BIG = 64 << 20;
+    void * big = malloc(BIG);
+    if (inScope) {
+      cheap::cheap<cheap::DISABLE_FREE> reg;
+      free(big);
+    } else {
+      free(big);
+    }
+    auto * small = malloc(cache_t::MaxSize);
+    assert(malloc_usable_size(small) < BIG);
+    free(small);
+  }
+  printf("sizecache: ok\n");
+  return 0;
+}
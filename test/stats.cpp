@@ -0,0 +1,39 @@
+#include <assert.h>
+#include <stdio.h>
+
+// Built with -DUSE_SCOPE_STATS=1 and -DCHEAP_HEADER_ONLY=1, so the
+// counters are kept without libcheap.
+#include "cheap_new.h"
+
+const int NUMOBJS = 100000;
+
+int main() {
+  static char * objs[NUMOBJS];
+  for (int round = 0; round < 2; round++) {
+    cheap::cheap<cheap::NONZERO | cheap::DISABLE_FREE> reg;
+    for (int i = 0; i < NUMOBJS; i++) {
+      objs[i] = new char[64];
+    }
+    for (int i = 0; i < NUMOBJS / 2; i++) {
+      delete [] objs[i];
+    }
+    auto s = cheap::stats();
+    assert(s.allocations == NUMOBJS);
+    assert(s.bytes == NUMOBJS * 64);
+    // 6.4MB out of a region whose first chunk is 3MB.
+    assert(s.refills >= 2);
+    assert(s.ignored_frees == NUMOBJS / 2);
+  }
+  // Freelist scopes reclaim their frees.
+  cheap::scope_stats s;
+  {
+    cheap::cheap<cheap::SAME_SIZE> fl(32);
+    objs[0] = new char[32];
+    delete [] objs[0];
+    s = cheap::stats(&fl);
+  }
+  assert((s.allocations == 1) && (s.bytes == 32));
+  assert((s.refills == 0) && (s.ignored_frees == 0));
+  printf("stats: ok\n");
+  return 0;
+}
@@ -0,0 +1,41 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cheap.h"
+#include "harness.h"
+
+// With CHEAP_TRACE=1, libcheap writes scope instances and region chunk
+// events as Chrome trace-event JSON at exit.
+
+const int NUMOBJS = 100000;
+
+int main(int, char * argv[]) {
+  if (!getenv("CHEAP_TRACE")) {
+    cheap_test::report_file trace;
+    cheap_test::runChild(argv, { { "CHEAP_TRACE", "1" }, { "CHEAP_TRACE_FILE", trace.path() } });
+    static char json[1 << 20];
+    auto n = trace.read(json, sizeof(json));
+    assert(strncmp(json, "{\"traceEvents\":[", 16) == 0);
+    assert(strstr(json, "\"cat\":\"scope\",\"ph\":\"X\""));
+    assert(strstr(json, "trace.cpp:"));
+    assert(strstr(json, "\"allocations\":100000,"));
+    assert(strstr(json, "\"name\":\"refill\""));
+    assert(strcmp(json + n - 4, "\n]}\n") == 0);
+    printf("trace: ok\n");
+    return 0;
+  }
+  static void * objs[NUMOBJS];
+  {
+    // 10MB: more than the region's first chunk.
+    cheap::cheap<cheap::DISABLE_FREE> reg;
+    for (int i = 0; i < NUMOBJS; i++) {
+      objs[i] = malloc(100);
+    }
+    for (int i = 0; i < NUMOBJS; i++) {
+      free(objs[i]);
+    }
+  }
+  return 0;
+}
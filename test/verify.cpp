@@ -0,0 +1,65 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cheap.h"
+#include "harness.h"
+
+// With CHEAP_VERIFY=<n>, libcheap samples allocating call stacks and
+// reports, per stack, the fraction of requests its scopes served.
+// Built with -rdynamic, so the report names the functions below.
+
+const int NUMOBJS = 10000;
+
+static void * objs[NUMOBJS];
+
+extern "C" __attribute__((noinline)) void scopedAllocations() {
+  for (int i = 0; i < NUMOBJS; i++) {
+    objs[i] = malloc(32);
+  }
+}
+
+extern "C" __attribute__((noinline)) void heapAllocations() {
+  for (int i = 0; i < NUMOBJS; i++) {
+    objs[i] = malloc(32);
+  }
+  for (int i = 0; i < NUMOBJS; i++) {
+    free(objs[i]);
+  }
+}
+
+/// The captured column of the report line whose stack starts in fn.
+static double captured(const char * report, const char * fn) {
+  char prefix[64];
+  snprintf(prefix, sizeof(prefix), "\t%s+", fn);
+  for (auto * line = report; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : nullptr) {
+    auto * end = strchr(line, '\n');
+    auto * at = strstr(line, prefix);
+    if (at && (!end || (at < end))) {
+      // samples, scoped, heap_in_scope, heap_outside, captured
+      return atof(cheap_test::field(line, 4));
+    }
+  }
+  return -1;
+}
+
+int main(int, char * argv[]) {
+  if (!getenv("CHEAP_VERIFY")) {
+    cheap_test::report_file stats;
+    cheap_test::runChild(argv, { { "CHEAP_VERIFY", "1" }, { "CHEAP_STATS_FILE", stats.path() } });
+    static char report[1 << 20];
+    stats.read(report, sizeof(report));
+    assert(strstr(report, "# cheap verify:"));
+    assert(captured(report, "scopedAllocations") == 100.0);
+    assert(captured(report, "heapAllocations") == 0.0);
+    printf("verify: ok\n");
+    return 0;
+  }
+  {
+    cheap::cheap<cheap::DISABLE_FREE> reg;
+    scopedAllocations();
+  }
+  heapAllocations();
+  return 0;
+}
@@ -0,0 +1,68 @@
+/* -*- C++ -*- */
+
+#pragma once
+
+#ifndef TRACEBUFFER_H
+#define TRACEBUFFER_H
+
+#include <stdint.h>
+#include <time.h>
+
+namespace cheap {
+
+  /// Nanoseconds on the monotonic clock (the timebase of trace events).
+  inline uint64_t nanoseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+  /**
+   * One thread's most recent trace events (see CHEAP_TRACE in
+   * README.md). Only its thread writes to it; once full, each new
+   * event overwrites the oldest. Read it after the thread is done (or
+   * at exit, accepting a torn last event).
+   */
+  class trace_ring {
+  public:
+
+    enum { Capacity = 16384 }; // events
+
+    enum { Scope = 0, Refill = 1, Release = 2 };
+
+    class event {
+    public:
+      uint64_t start;       // ns
+      uint64_t duration;    // ns
+      uint64_t bytes;       // requested in the scope, or a refill's chunk size
+      uint32_t allocations; // scopes only
+      uint32_t spills;      // scopes only
+      uint16_t kind;
+      uint16_t site;        // scopes only: index into libcheap's sites
+    };
+
+    inline void push(const event& e) {
+      _events[_next % Capacity] = e;
+      _next++;
+    }
+
+    /// Call fn on each event, oldest first.
+    template <class Fn>
+    void forEach(Fn fn) const {
+      uint64_t first = (_next > Capacity) ? _next - Capacity : 0;
+      for (auto i = first; i < _next; i++) {
+	fn(_events[i % Capacity]);
+      }
+    }
+
+    int tid {0};
+    trace_ring * next {nullptr};
+
+  private:
+    uint64_t _next {0};
+    event _events[Capacity];
+  };
+
+}
+
+#endif